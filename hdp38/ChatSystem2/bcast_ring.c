@@ -0,0 +1,183 @@
+/* Shared-memory broadcast ring.
+ *
+ * The server writes each broadcast once into a ring in POSIX shared memory
+ * and every client reads it from there with its own cursor, instead of the
+ * server pushing one copy per client through the client MQs. Sleeping readers
+ * are woken through a futex on the ring head.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#define _GNU_SOURCE // For syscall()
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "bcast_ring.h"
+
+static size_t
+ring_size(uint32_t num_slots)
+{
+    return sizeof(struct bcast_ring) + num_slots * sizeof(struct ring_entry);
+}
+
+/* Create a fresh ring for the server. Any ring left by an earlier server is replaced. */
+struct bcast_ring *bcast_ring_create(const char *name)
+{
+    struct bcast_ring *ring;
+    size_t size = ring_size(RING_SLOTS);
+    int fd;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, size) == -1)
+    {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    /* ftruncate zero-fills, so every entry starts out empty */
+    ring->num_slots = RING_SLOTS;
+    ring->head = 0;
+    ring->waiters = 0;
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+/* Map the ring of a running server. Returns NULL if the server does not use one. */
+struct bcast_ring *bcast_ring_attach(const char *name)
+{
+    struct bcast_ring *ring;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct bcast_ring))
+    {
+        close(fd);
+        return NULL;
+    }
+    ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+        (size_t)st.st_size < ring_size(ring->num_slots))
+    {
+        munmap(ring, st.st_size);
+        return NULL;
+    }
+    return ring;
+}
+
+void bcast_ring_detach(struct bcast_ring *ring)
+{
+    munmap(ring, ring_size(ring->num_slots));
+}
+
+/* Append a broadcast. Only the server calls this, from a single thread. */
+void bcast_ring_publish(struct bcast_ring *ring, pid_t sender_pid, const void *data, uint32_t len)
+{
+    uint32_t seq = ring->head;
+    struct ring_entry *entry = &ring->entries[seq & (ring->num_slots - 1)];
+
+    if (len > RING_DATA_LEN)
+    {
+        len = RING_DATA_LEN;
+    }
+
+    /* Invalidate the slot before overwriting it so lapped readers notice */
+    __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->sender_pid = sender_pid;
+    entry->len = len;
+    memcpy(entry->data, data, len);
+    __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELEASE);
+    /* Sequentially consistent so the store to head and the load of waiters are
+     * not reordered against a reader registering as a waiter.
+     */
+    __atomic_store_n(&ring->head, seq + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST) > 0)
+    {
+        syscall(SYS_futex, &ring->head, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/* Copy the broadcast at *cursor into entry and advance the cursor.
+ * Returns 1 if a broadcast was read and 0 if the reader is caught up.
+ * Broadcasts overwritten before the reader got to them are skipped and
+ * added to *dropped.
+ */
+int bcast_ring_read(struct bcast_ring *ring, uint32_t *cursor, struct ring_entry *entry, uint32_t *dropped)
+{
+    struct ring_entry *slot;
+    uint32_t head, seq;
+
+    while (1)
+    {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (*cursor == head)
+        {
+            return 0;
+        }
+        if (head - *cursor > ring->num_slots)
+        {
+            /* Lapped by the writer, jump to the oldest entry still in the ring */
+            *dropped += head - ring->num_slots - *cursor;
+            *cursor = head - ring->num_slots;
+        }
+
+        slot = &ring->entries[*cursor & (ring->num_slots - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == *cursor + 1)
+        {
+            entry->sender_pid = slot->sender_pid;
+            entry->len = slot->len <= RING_DATA_LEN ? slot->len : RING_DATA_LEN;
+            memcpy(entry->data, slot->data, entry->len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            {
+                (*cursor)++;
+                return 1;
+            }
+        }
+
+        /* The slot was overwritten under us, count it as dropped */
+        (*dropped)++;
+        (*cursor)++;
+    }
+}
+
+/* Sleep until the writer publishes past cursor */
+void bcast_ring_wait(struct bcast_ring *ring, uint32_t cursor)
+{
+    __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    /* The kernel rechecks head == cursor, so a publish racing with us is not missed */
+    syscall(SYS_futex, &ring->head, FUTEX_WAIT, cursor, NULL, NULL, 0);
+    __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+}
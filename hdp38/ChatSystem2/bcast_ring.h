@@ -0,0 +1,43 @@
+#ifndef _BCAST_RING_H_
+#define _BCAST_RING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "msg_structure.h"
+
+#define RING_NAME "/hdp38_njs76_chat_ring"
+#define RING_MAGIC 0x52494e47u          /* "RING" */
+#define RING_SLOTS 1024                 /* Must be a power of two */
+#define RING_DATA_LEN FRAME_MAX
+
+/* One broadcast frame in the ring. seq is set to (sequence number + 1) once the
+ * entry is complete and cleared while it is being overwritten, so a reader
+ * can tell whether the copy it took is intact.
+ */
+struct ring_entry {
+    uint32_t seq;
+    pid_t sender_pid;                   /* Readers skip their own broadcasts */
+    uint32_t len;
+    char data[RING_DATA_LEN];
+};
+
+/* Single-writer, multi-reader broadcast ring in POSIX shared memory.
+ * head is the sequence number of the next broadcast and doubles as the futex
+ * word readers sleep on; the writer only wakes them when waiters is non-zero.
+ */
+struct bcast_ring {
+    uint32_t magic;
+    uint32_t num_slots;
+    uint32_t head;
+    uint32_t waiters;
+    struct ring_entry entries[];
+};
+
+struct bcast_ring *bcast_ring_create(const char *name);
+struct bcast_ring *bcast_ring_attach(const char *name);
+void bcast_ring_detach(struct bcast_ring *ring);
+void bcast_ring_publish(struct bcast_ring *ring, pid_t sender_pid, const void *data, uint32_t len);
+int bcast_ring_read(struct bcast_ring *ring, uint32_t *cursor, struct ring_entry *entry, uint32_t *dropped);
+void bcast_ring_wait(struct bcast_ring *ring, uint32_t cursor);
+
+#endif
@@ -0,0 +1,119 @@
+/* Chat channels of the chat server.
+ *
+ * A channel exists while it has subscribers. Its subscriptions are a bitset
+ * with one bit per registry slot; the fan-out workers walk the set words
+ * with count-trailing-zeros, so a post costs one step per subscriber plus
+ * one per 64 slots.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "channel.h"
+
+int channel_init(struct channel_table *table, int max_channels, int max_clients)
+{
+    table->max_channels = max_channels;
+    table->words = (max_clients + CHANNEL_WORD_BITS - 1) / CHANNEL_WORD_BITS;
+    table->channels = calloc(max_channels, sizeof(struct channel));
+    if (table->channels == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < max_channels; i++)
+    {
+        table->channels[i].members = calloc(table->words, sizeof(uint64_t));
+        if (table->channels[i].members == NULL)
+        {
+            channel_destroy(table);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void channel_destroy(struct channel_table *table)
+{
+    if (table->channels != NULL)
+    {
+        for (int i = 0; i < table->max_channels; i++)
+        {
+            free(table->channels[i].members);
+        }
+    }
+    free(table->channels);
+    memset(table, 0, sizeof(*table));
+}
+
+/* Return the index of a channel or -1 if nobody is subscribed to it */
+int channel_find(const struct channel_table *table, const char *name)
+{
+    for (int i = 0; i < table->max_channels; i++)
+    {
+        if (table->channels[i].in_use && strcmp(table->channels[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Subscribe a slot, creating the channel if needed. Returns the channel index
+ * or -1 if every channel is taken.
+ */
+int channel_subscribe(struct channel_table *table, const char *name, int slot)
+{
+    struct channel *channel;
+    int ch = channel_find(table, name);
+
+    if (ch < 0)
+    {
+        ch = 0;
+        while (ch < table->max_channels && table->channels[ch].in_use)
+        {
+            ch++;
+        }
+        if (ch == table->max_channels)
+        {
+            return -1;
+        }
+        channel = &table->channels[ch];
+        snprintf(channel->name, sizeof(channel->name), "%s", name);
+        channel->in_use = 1;
+    }
+
+    channel = &table->channels[ch];
+    if (!channel_has(channel, slot))
+    {
+        channel->members[slot / CHANNEL_WORD_BITS] |= (uint64_t)1 << (slot % CHANNEL_WORD_BITS);
+        channel->num_members++;
+    }
+    return ch;
+}
+
+/* Unsubscribe a slot; the channel goes away with its last subscriber */
+void channel_unsubscribe(struct channel_table *table, int ch, int slot)
+{
+    struct channel *channel = &table->channels[ch];
+
+    if (!channel->in_use || !channel_has(channel, slot))
+    {
+        return;
+    }
+    channel->members[slot / CHANNEL_WORD_BITS] &= ~((uint64_t)1 << (slot % CHANNEL_WORD_BITS));
+    if (--channel->num_members == 0)
+    {
+        channel->in_use = 0;
+        memset(channel->name, '\0', sizeof(channel->name));
+    }
+}
+
+/* Remove a client that is leaving from every channel */
+void channel_drop_client(struct channel_table *table, int slot)
+{
+    for (int i = 0; i < table->max_channels; i++)
+    {
+        channel_unsubscribe(table, i, slot);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include <stdint.h>
+#include "msg_structure.h"
+
+#define CHANNEL_WORD_BITS 64
+
+/* A named channel. Subscribers are kept as a bitset over registry slots so a
+ * post only visits the clients that asked for the channel.
+ */
+struct channel {
+    char name[USER_NAME_LEN];
+    int in_use;                         /* 1 while the channel has subscribers */
+    int num_members;
+    uint64_t *members;                  /* Bit n set if slot n is subscribed */
+};
+
+struct channel_table {
+    int max_channels;
+    int words;                          /* uint64_t words in each bitset */
+    struct channel *channels;
+};
+
+int channel_init(struct channel_table *table, int max_channels, int max_clients);
+void channel_destroy(struct channel_table *table);
+int channel_find(const struct channel_table *table, const char *name);
+int channel_subscribe(struct channel_table *table, const char *name, int slot);
+void channel_unsubscribe(struct channel_table *table, int ch, int slot);
+void channel_drop_client(struct channel_table *table, int slot);
+
+static inline int
+channel_has(const struct channel *channel, int slot)
+{
+    return (channel->members[slot / CHANNEL_WORD_BITS] >> (slot % CHANNEL_WORD_BITS)) & 1;
+}
+
+#endif
@@ -0,0 +1,717 @@
+/* Load generator and latency benchmark for the chat system.
+ *
+ * Compile as follows: gcc -o chat_bench chat_bench.c bcast_ring.c -std=c99 -Wall -lrt -lpthread
+ *
+ * Usage: chat_bench [-c clients] [-b broadcasts/s] [-p privates/s] [-s size] [-d seconds]
+ *                   [-u] [-S server] [-- server-args]
+ *
+ *   -c  Number of headless clients to fork (default 10)
+ *   -b  Broadcasts per second sent by each client (default 10)
+ *   -p  Private messages per second sent by each client (default 10)
+ *   -s  Message text size in bytes (default 64)
+ *   -d  Seconds to send for (default 5)
+ *   -u  Clients talk to the server over its Unix-domain socket; -u is passed
+ *       to the server as well
+ *   -S  Server binary to start (default ./hdp38_njs76_chat_server); anything
+ *       after -- is passed to it
+ *
+ * Every message carries its CLOCK_MONOTONIC send time in the text, so the
+ * receiving client can compute the delivery latency. At the end the parent
+ * collects the samples from every client and prints delivered throughput,
+ * p50/p99/p999 latency, the number of deliveries that never arrived and the
+ * CPU time the server used, summed over all of its shards.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+
+#define _GNU_SOURCE // For clock_gettime(), getopt() and MSG_NOSIGNAL
+#define DEFAULT_SERVER "./hdp38_njs76_chat_server"
+#define MAX_SAMPLES (1 << 20) /* Latency samples kept per client */
+#define START_DELAY_MS 1000   /* Time for every client to join before sending */
+#define DRAIN_MS 1000         /* Time to keep receiving after the last send */
+
+#include <mqueue.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "msg_structure.h"
+#include "bcast_ring.h"
+
+/* What each client reports back to the parent, followed by num_samples latencies in microseconds */
+struct bench_result {
+    unsigned long sent_broadcast;
+    unsigned long sent_private;
+    unsigned long received;
+    unsigned long notices;              /* Notices from the server, e.g. missed messages */
+    unsigned long num_samples;
+};
+
+struct bench_config {
+    int num_clients;
+    double broadcast_rate;
+    double private_rate;
+    int size;
+    int duration;
+    int use_socket;
+};
+
+/* State of the headless client run by this process */
+static uint32_t session_id = SESSION_NONE;
+static uint32_t *peer_ids; /* Session id of each bench client, learned from its messages */
+static int num_peers;
+static int server_sock = -1; /* Connection to the server with -u */
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read the parent and utime + stime, in clock ticks, of a process. Returns -1 if it is gone. */
+static int
+read_proc_stat(pid_t pid, pid_t *ppid, long *ticks)
+{
+    char path[64];
+    char stat[1024];
+    char *p;
+    unsigned long utime, stime;
+    int parent;
+    FILE *file;
+    size_t n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    n = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[n] = '\0';
+
+    /* The command name may contain spaces; fields resume after its closing ')' */
+    p = strrchr(stat, ')');
+    if (p == NULL ||
+        sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &parent, &utime, &stime) != 3)
+    {
+        return -1;
+    }
+    *ppid = parent;
+    *ticks = utime + stime;
+    return 0;
+}
+
+/* CPU time of the server in clock ticks: shard 0 and the shards it forked,
+ * found as its children in /proc. Returns -1 if the server is gone.
+ */
+static long
+server_cpu_ticks(pid_t server_pid)
+{
+    DIR *dir;
+    struct dirent *ent;
+    pid_t pid, ppid;
+    long ticks, total;
+
+    if (read_proc_stat(server_pid, &ppid, &total) == -1)
+    {
+        return -1;
+    }
+    dir = opendir("/proc");
+    if (dir == NULL)
+    {
+        return total;
+    }
+    while ((ent = readdir(dir)) != NULL)
+    {
+        pid = atoi(ent->d_name);
+        if (pid > 0 && pid != server_pid && read_proc_stat(pid, &ppid, &ticks) == 0 && ppid == server_pid)
+        {
+            total += ticks;
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+/* Count the shards of the server. The shard queues are numbered from 0, so
+ * count them until one is missing.
+ */
+static int
+count_shards(void)
+{
+    char server_name[MESSAGE_LEN];
+    int num_shards = 1;
+    mqd_t mqd;
+
+    while (num_shards < SHARD_MAX)
+    {
+        shard_server_name(server_name, sizeof(server_name), num_shards);
+        mqd = mq_open(server_name, O_WRONLY);
+        if (mqd == (mqd_t)-1)
+        {
+            break;
+        }
+        mq_close(mqd);
+        num_shards++;
+    }
+    return num_shards;
+}
+
+/* Open the server MQ of the shard owning a user name */
+static mqd_t
+open_server(const char *user_name)
+{
+    char server_name[MESSAGE_LEN];
+
+    shard_server_name(server_name, sizeof(server_name), shard_of(user_name, count_shards()));
+    return mq_open(server_name, O_WRONLY);
+}
+
+/* Connect to the socket of the shard owning a user name. Returns -1 on failure. */
+static int
+connect_server(const char *user_name)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    int fd;
+
+    len = shard_socket_addr(&addr, shard_of(user_name, count_shards()));
+    fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void
+send_frame(mqd_t mqd_server, struct frame *f)
+{
+    if (server_sock != -1)
+    {
+        if (send(server_sock, f->u.buf, frame_size(f), MSG_NOSIGNAL) == -1)
+        {
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (mq_send(mqd_server, f->u.buf, frame_size(f), frame_priority(f->u.hdr.type)) == -1)
+    {
+        perror("mq_send");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Read one waiting frame from the client MQ or the connection. Returns its size, -1 if none. */
+static ssize_t
+receive_frame(mqd_t mqd, struct frame *f)
+{
+    if (server_sock != -1)
+    {
+        return recv(server_sock, f->u.buf, FRAME_MAX, MSG_DONTWAIT);
+    }
+    return mq_receive(mqd, f->u.buf, FRAME_MAX, NULL);
+}
+
+/* Account for one frame delivered to this client */
+static void
+record_frame(struct frame *f, struct bench_result *result, uint32_t *samples)
+{
+    struct frame batched;
+    char sender_name[USER_NAME_LEN];
+    char text[FRAME_MAX];
+    long long sent;
+    int peer;
+
+    switch (f->u.hdr.type)
+    {
+    case MSG_FRAME_BATCH:
+        while (frame_batch_next(f, &batched) == 0)
+        {
+            record_frame(&batched, result, samples);
+        }
+        break;
+
+    case MSG_JOIN_ACK:
+        session_id = f->u.hdr.target;
+        break;
+
+    case MSG_NOTICE:
+        result->notices++;
+        break;
+
+    case MSG_BROADCAST:
+    case MSG_PRIVATE:
+        if (frame_get_str(f, sender_name) == -1)
+        {
+            break;
+        }
+        if (sscanf(sender_name, "bench%d", &peer) == 1 && peer >= 0 && peer < num_peers)
+        {
+            peer_ids[peer] = f->u.hdr.sender;
+        }
+        frame_get_text(f, text, sizeof(text));
+        result->received++;
+        if (sscanf(text, "%lld", &sent) == 1 && result->num_samples < MAX_SAMPLES)
+        {
+            samples[result->num_samples++] = (uint32_t)((now_ns() - sent) / 1000);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Headless client: join, send at the configured rates, record every delivery */
+static void
+run_client(int id, const struct bench_config *config, int64_t start, int out_fd)
+{
+    char user_name[USER_NAME_LEN];
+    char recipient[USER_NAME_LEN];
+    char client_name[MESSAGE_LEN];
+    char text[FRAME_MAX];
+    struct bench_result result;
+    struct mq_attr attr;
+    struct frame f;
+    struct pollfd pfd;
+    struct bcast_ring *ring;
+    struct ring_entry entry;
+    uint32_t ring_cursor = 0;
+    uint32_t dropped = 0;
+    uint32_t *samples;
+    mqd_t mqd, mqd_server;
+    ssize_t nr;
+    int64_t now, next_send, end, interval;
+    double total_rate = config->broadcast_rate + config->private_rate;
+    double private_share = 0;
+    unsigned int seed = id + 1;
+    int timeout;
+    int len;
+    int peer;
+
+    memset(&result, 0, sizeof(result));
+    samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+    num_peers = config->num_clients;
+    peer_ids = calloc(num_peers, sizeof(uint32_t));
+    if (samples == NULL || peer_ids == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(user_name, sizeof(user_name), "bench%d", id);
+    snprintf(client_name, MESSAGE_LEN, "/hdp38_njs76_client_%s", user_name);
+    attr.mq_maxmsg = 10;
+    attr.mq_msgsize = FRAME_MAX;
+    mq_unlink(client_name);
+    if (config->use_socket)
+    {
+        mqd = mqd_server = (mqd_t)-1;
+        server_sock = connect_server(user_name);
+        if (server_sock == -1)
+        {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        mqd = mq_open(client_name, O_RDONLY | O_CREAT | O_NONBLOCK, S_IRUSR | S_IWUSR, &attr);
+        mqd_server = open_server(user_name);
+        if (mqd == (mqd_t)-1 || mqd_server == (mqd_t)-1)
+        {
+            perror("mq_open");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Broadcasts come through the ring when the server uses one */
+    ring = bcast_ring_attach(RING_NAME);
+    if (ring != NULL)
+    {
+        ring_cursor = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    frame_init(&f, MSG_JOIN, SESSION_NONE);
+    frame_put_str(&f, user_name);
+    frame_put_u32(&f, getpid());
+    send_frame(mqd_server, &f);
+
+    interval = total_rate > 0 ? (int64_t)(1e9 / total_rate) : 0;
+    next_send = start;
+    end = start + (int64_t)config->duration * 1000000000;
+    pfd.fd = server_sock != -1 ? server_sock : (int)mqd; /* On Linux an mqd_t is a pollable descriptor */
+    pfd.events = POLLIN;
+
+    /* Wait for the join acknowledgement */
+    while (session_id == SESSION_NONE)
+    {
+        if (poll(&pfd, 1, START_DELAY_MS) != 1)
+        {
+            fprintf(stderr, "%s: no join acknowledgement\n", user_name);
+            exit(EXIT_FAILURE);
+        }
+        while ((nr = receive_frame(mqd, &f)) > 0)
+        {
+            if (frame_check(&f, nr) == 0)
+            {
+                record_frame(&f, &result, samples);
+            }
+        }
+    }
+
+    while ((now = now_ns()) < end + (int64_t)DRAIN_MS * 1000000)
+    {
+        if (interval > 0 && now >= next_send && now < end)
+        {
+            /* Interleave private messages and broadcasts in proportion to their rates */
+            private_share += config->private_rate / total_rate;
+            if (private_share >= 1 && config->num_clients > 1)
+            {
+                private_share -= 1;
+                peer = (id + 1 + rand_r(&seed) % (config->num_clients - 1)) % config->num_clients;
+                frame_init(&f, MSG_PRIVATE, session_id);
+                f.u.hdr.target = peer_ids[peer];
+                if (f.u.hdr.target == SESSION_NONE)
+                {
+                    /* Not heard from that client yet, address it by name */
+                    snprintf(recipient, sizeof(recipient), "bench%d", peer);
+                    frame_put_str(&f, recipient);
+                }
+                result.sent_private++;
+            }
+            else
+            {
+                frame_init(&f, MSG_BROADCAST, session_id);
+                result.sent_broadcast++;
+            }
+            len = snprintf(text, sizeof(text), "%lld ", (long long)now_ns());
+            while (len < config->size)
+            {
+                text[len++] = 'x';
+            }
+            frame_put_text(&f, text, len);
+            send_frame(mqd_server, &f);
+            next_send += interval;
+        }
+
+        while ((nr = receive_frame(mqd, &f)) > 0)
+        {
+            if (frame_check(&f, nr) == 0)
+            {
+                record_frame(&f, &result, samples);
+            }
+        }
+        if (ring != NULL)
+        {
+            while (bcast_ring_read(ring, &ring_cursor, &entry, &dropped))
+            {
+                memcpy(f.u.buf, entry.data, entry.len);
+                if (entry.sender_pid != getpid() && frame_check(&f, entry.len) == 0)
+                {
+                    record_frame(&f, &result, samples);
+                }
+            }
+        }
+
+        /* Sleep until the next send or the next delivery */
+        now = now_ns();
+        if (interval > 0 && now < end)
+        {
+            timeout = next_send > now ? (int)((next_send - now) / 1000000) : 0;
+        }
+        else
+        {
+            timeout = 10;
+        }
+        if (ring != NULL && timeout > 1)
+        {
+            timeout = 1;
+        }
+        if (poll(&pfd, 1, timeout) == -1 && errno != EINTR)
+        {
+            perror("poll");
+        }
+    }
+
+    frame_init(&f, MSG_LEAVE, session_id);
+    send_frame(mqd_server, &f);
+    if (mqd != (mqd_t)-1)
+    {
+        mq_close(mqd);
+        mq_unlink(client_name);
+    }
+
+    if (write(out_fd, &result, sizeof(result)) != sizeof(result) ||
+        write(out_fd, samples, result.num_samples * sizeof(uint32_t)) !=
+            (ssize_t)(result.num_samples * sizeof(uint32_t)))
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/* Read exactly len bytes from a pipe */
+static int
+read_full(int fd, void *buf, size_t len)
+{
+    ssize_t nr;
+    size_t done = 0;
+
+    while (done < len)
+    {
+        nr = read(fd, (char *)buf + done, len - done);
+        if (nr <= 0)
+        {
+            return -1;
+        }
+        done += nr;
+    }
+    return 0;
+}
+
+static int
+compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t
+percentile(uint32_t *sorted, unsigned long n, double p)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    return sorted[(unsigned long)(p * (n - 1))];
+}
+
+static pid_t
+start_server(const char *server, char **server_args, int num_args, int use_socket)
+{
+    char **args;
+    mqd_t mqd_server;
+    pid_t pid;
+
+    args = calloc(num_args + 3, sizeof(char *));
+    if (args == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    args[0] = (char *)server;
+    memcpy(args + 1, server_args, num_args * sizeof(char *));
+    if (use_socket)
+    {
+        args[num_args + 1] = "-u";
+    }
+
+    mq_unlink(SERVER_NAME);
+    pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        execv(server, args);
+        perror("execv");
+        _exit(EXIT_FAILURE);
+    }
+    free(args);
+
+    /* Wait for the server MQ to appear */
+    for (int i = 0; i < 200; i++)
+    {
+        mqd_server = mq_open(SERVER_NAME, O_WRONLY);
+        if (mqd_server != (mqd_t)-1)
+        {
+            mq_close(mqd_server);
+            return pid;
+        }
+        nanosleep(&(struct timespec){0, 10000000}, NULL);
+    }
+    fprintf(stderr, "Server did not start\n");
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config = {10, 10, 10, 64, 5, 0};
+    const char *server = DEFAULT_SERVER;
+    struct bench_result result, total;
+    uint32_t *samples;
+    unsigned long num_samples = 0;
+    unsigned long expected;
+    long ticks_before, ticks_after;
+    int64_t start, window_start, window_end;
+    pid_t server_pid;
+    pid_t *pids;
+    int *fds;
+    int pipefd[2];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:b:p:s:d:uS:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            config.num_clients = atoi(optarg);
+            break;
+        case 'b':
+            config.broadcast_rate = atof(optarg);
+            break;
+        case 'p':
+            config.private_rate = atof(optarg);
+            break;
+        case 's':
+            config.size = atoi(optarg);
+            break;
+        case 'd':
+            config.duration = atoi(optarg);
+            break;
+        case 'u':
+            config.use_socket = 1;
+            break;
+        case 'S':
+            server = optarg;
+            break;
+        default:
+            printf("Usage: %s [-c clients] [-b broadcasts/s] [-p privates/s] [-s size] [-d seconds] "
+                   "[-u] [-S server] [-- server-args]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (config.num_clients <= 0 || config.duration <= 0 || config.broadcast_rate < 0 || config.private_rate < 0)
+    {
+        printf("clients and seconds must be positive, rates must not be negative\n");
+        exit(EXIT_FAILURE);
+    }
+    /* Leave room for the two names in a private frame */
+    if (config.size < 24)
+    {
+        config.size = 24;
+    }
+    if (config.size > (int)FRAME_PAYLOAD_MAX - 2 * USER_NAME_LEN)
+    {
+        config.size = FRAME_PAYLOAD_MAX - 2 * USER_NAME_LEN;
+    }
+
+    server_pid = start_server(server, argv + optind, argc - optind, config.use_socket);
+
+    pids = malloc(config.num_clients * sizeof(pid_t));
+    fds = malloc(config.num_clients * sizeof(int));
+    samples = NULL;
+    if (pids == NULL || fds == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now_ns() + (int64_t)START_DELAY_MS * 1000000;
+    for (int i = 0; i < config.num_clients; i++)
+    {
+        if (pipe(pipefd) == -1)
+        {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        pids[i] = fork();
+        if (pids[i] == -1)
+        {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pids[i] == 0)
+        {
+            close(pipefd[0]);
+            run_client(i, &config, start, pipefd[1]);
+        }
+        close(pipefd[1]);
+        fds[i] = pipefd[0];
+    }
+
+    /* Measure the server over the sending and draining window */
+    while (now_ns() < start)
+    {
+        nanosleep(&(struct timespec){0, 1000000}, NULL);
+    }
+    window_start = now_ns();
+    ticks_before = server_cpu_ticks(server_pid);
+
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < config.num_clients; i++)
+    {
+        if (read_full(fds[i], &result, sizeof(result)) == -1 ||
+            (samples = realloc(samples, (num_samples + result.num_samples + 1) * sizeof(uint32_t))) == NULL ||
+            read_full(fds[i], samples + num_samples, result.num_samples * sizeof(uint32_t)) == -1)
+        {
+            fprintf(stderr, "Client %d did not report\n", i);
+            continue;
+        }
+        close(fds[i]);
+        total.sent_broadcast += result.sent_broadcast;
+        total.sent_private += result.sent_private;
+        total.received += result.received;
+        total.notices += result.notices;
+        num_samples += result.num_samples;
+    }
+    window_end = now_ns();
+    ticks_after = server_cpu_ticks(server_pid);
+
+    for (int i = 0; i < config.num_clients; i++)
+    {
+        waitpid(pids[i], NULL, 0);
+    }
+    kill(server_pid, SIGINT);
+    waitpid(server_pid, NULL, 0);
+
+    qsort(samples, num_samples, sizeof(uint32_t), compare_u32);
+    expected = total.sent_broadcast * (config.num_clients - 1) + total.sent_private;
+
+    printf("clients %d, %.1f broadcasts/s and %.1f privates/s each, %d byte messages, %d s, over %s\n",
+           config.num_clients, config.broadcast_rate, config.private_rate, config.size, config.duration,
+           config.use_socket ? "sockets" : "mqueues");
+    printf("sent        %lu broadcasts, %lu private\n", total.sent_broadcast, total.sent_private);
+    printf("delivered   %lu of %lu (%.1f msgs/s)\n", total.received, expected,
+           total.received / (double)config.duration);
+    printf("dropped     %lu (%lu server notices)\n",
+           expected > total.received ? expected - total.received : 0, total.notices);
+    printf("latency us  p50 %u  p99 %u  p999 %u  max %u\n", percentile(samples, num_samples, 0.50),
+           percentile(samples, num_samples, 0.99), percentile(samples, num_samples, 0.999),
+           num_samples > 0 ? samples[num_samples - 1] : 0);
+    if (ticks_before >= 0 && ticks_after >= 0)
+    {
+        printf("server cpu  %.2f s (%.1f%%)\n", (ticks_after - ticks_before) / (double)sysconf(_SC_CLK_TCK),
+               100.0 * (ticks_after - ticks_before) / sysconf(_SC_CLK_TCK) / ((window_end - window_start) / 1e9));
+    }
+
+    free(samples);
+    free(pids);
+    free(fds);
+    exit(EXIT_SUCCESS);
+}
@@ -1,6 +1,23 @@
 /* Skeleton code for the client side code. 
  *
- * Compile as follows: gcc -o chat_client chat_client.c -std=c99 -Wall -lrt
+ * Compile as follows: gcc -o chat_client chat_client.c bcast_ring.c -std=c99 -Wall -lrt -lpthread
+ *
+ * Usage: chat_client [-u] [-H] user-name
+ *
+ *   -u  Talk to the server over a Unix-domain socket instead of MQs. The
+ *       server has to be started with -u as well.
+ *   -H  Headless: no menu. Read one command per line from stdin as fast as
+ *       it comes, "B text", "P user text", "J channel", "L channel",
+ *       "C channel text" or "E", and leave at the end of input. Print
+ *       every delivery as one tab-separated line:
+ *           JOINED <session id>
+ *           B <sender> <text>
+ *           P <sender> <text>
+ *           C <channel> <sender> <text>
+ *           NOTICE <text>
+ *           MISSED <messages>
+ *       and FULL, TAKEN or LOST if the server is full, another client has
+ *       the name or the server is gone.
  *
  * Author: Naga Kandsamy
  * Date created: January 28, 2020
@@ -9,106 +26,1242 @@
  * Student/team name: Hoang Pham and Nicholas Syrylo
  * Date created: 2/16/2020
  *
+ * A receiver thread that lives as long as the client blocks on the client MQ
+ * with one buffer it keeps throughout. It drains whatever is waiting and
+ * prints the burst with one write. If the server publishes broadcasts
+ * through the shared-memory ring, another reader thread picks them up from
+ * there.
+ *
+ * Frames to the server are collected in an outbox and sent as one batch frame
+ * once no more input is waiting on stdin. A batch only holds frames of one
+ * priority, so it never carries a fragment past the ones queued before it.
+ *
+ * The client learns its session id from the join acknowledgement and the ids
+ * of other users from the messages they send, and addresses private messages
+ * by id once it knows it.
+ *
+ * If the server runs as several shards, the client talks only to the shard
+ * its name hashes to.
+ *
+ * On a socket, the receiver thread blocks in recv() instead, and the server
+ * closing the connection is noticed at once rather than by the watchdog.
+ *
+ * Headless, the main thread waits on stdin, the server and a heartbeat
+ * timerfd in one poll() instead, and there is no receiver thread.
+ *
+ * Messages longer than fit in one frame, up to MESSAGE_MAX bytes, go out as
+ * fragments in the bulk priority lane. Each receiver thread puts incoming
+ * fragments back together in one of REASSEMBLY_SLOTS buffers and prints the
+ * message once it is complete. A message missing a fragment, or pushed out
+ * by newer ones when every buffer is taken, is dropped.
+ *
+ * Chat frames from the server are numbered in each priority lane. A frame
+ * that comes after a missing one is held, up to REORDER_LEN per lane, while
+ * the missing one is asked for again with a nack. It is given up and noted
+ * as missed once the server says it is gone, after NACK_TRIES tries, or when
+ * there is no more room to hold what follows. What arrived in order is
+ * acknowledged every ACK_EVERY frames and whenever the server asks with an
+ * ack of its own. That ack may overtake the frames it counts, so those are
+ * only asked for once GAP_TIMEOUT_MS passes without them. Acks and nacks go
+ * out together after each burst.
+ *
+ * Any frame from the server shows that it is alive; a watchdog on SIGALRM
+ * gives up after HEARTBEAT_MISSES silent intervals. The client answers with a
+ * heartbeat of its own when it has sent nothing for an interval, so the
+ * server does not time it out.
+ *
 */
 
-#define _POSIX_C_SOURCE 2 // For getopt()
-#define SERVER_NAME "/hdp38_njs76_chat_server"
+#define _GNU_SOURCE // For getopt(), flockfile() and MSG_NOSIGNAL
 #define KILL 10
 #define FULL 20
+#define LOST 30
+#define TAKEN 40
+#define PEER_CACHE 64 /* Other users whose session id we remember */
+#define WRITER_LEN 8192 /* Output a receiver thread buffers before writing it */
+#define WRITER_LINE_MAX (FRAME_MAX + 3 * USER_NAME_LEN) /* Longest line print_frame() writes */
+#define COMMAND_BUF (MESSAGE_MAX + 4 * USER_NAME_LEN) /* Headless input read at a time, enough for the longest command */
+#define REASSEMBLY_SLOTS 8 /* Long messages being received at once */
+#define REORDER_LEN 128 /* Frames of a lane held after a missing one, as many as the server keeps to send again */
+#define ACK_EVERY 32 /* Frames of a lane received before they are acknowledged */
+#define GAP_TIMEOUT_MS 1000 /* Wait for a missing frame before asking again */
+#define NACK_TRIES 3 /* Times a missing frame is asked for again before it is given up */
+#define HELD_FRAME 1 /* seq_lane.have: the frame is held */
+#define HELD_LOST 2  /* seq_lane.have: the server no longer has the frame */
 
 #include <mqueue.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <stdarg.h>
 #include "msg_structure.h"
+#include "bcast_ring.h"
 #include <signal.h>
 #include <time.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <poll.h>
 static sigjmp_buf env;
-time_t start_t;
+static char user_name[USER_NAME_LEN];
+static mqd_t mqd_server;
+static int server_sock = -1; /* Connection to the server with -u */
+static int leaving; /* Set once we said we leave, so the server closing the connection is expected */
+static int headless; /* -H: commands from stdin, deliveries as lines */
+static time_t last_heard; /* Last time anything arrived from the server */
+static time_t last_sent;  /* Last time anything was sent to the server */
+static uint32_t session_id = SESSION_NONE; /* Set by the join acknowledgement */
+
+/* Session ids of the users we have heard from, replaced round robin */
+struct peer {
+    char user_name[USER_NAME_LEN];
+    uint32_t id;
+};
+static struct peer peers[PEER_CACHE];
+static int next_peer;
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bcast_ring *ring; /* Server broadcast ring, NULL if not in use */
+static uint32_t ring_cursor;
+static struct frame outbox; /* Frames not yet sent to the server */
+static int outbox_count;
+static unsigned int outbox_prio; /* Priority of the frames in the outbox */
+static uint32_t next_message_id; /* Of our last long message */
+
+/* A long message being put back together */
+struct reassembly {
+    uint32_t sender;                    /* Session id of the sender, SESSION_NONE if the slot is free */
+    uint32_t id;
+    uint32_t total;
+    uint32_t received;                  /* Bytes of text so far, always from the start */
+    uint32_t age;                       /* Started after every slot with a lower age */
+    char *text;
+};
+static struct reassembly reassembly[REASSEMBLY_SLOTS];
+static uint32_t reassembly_age;
+static pthread_mutex_t reassembly_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Numbered frames of one lane from the server, put back in order. Only the
+ * thread reading the server link touches these.
+ */
+struct seq_lane {
+    uint32_t last;                      /* Every frame up to this one was printed or given up */
+    uint32_t highest;                   /* Highest the server is known to have sent; a gap while above last */
+    uint32_t acked;                     /* Last one acknowledged to the server */
+    int64_t gap_ms;                     /* When the first missing frame was last waited for */
+    int tries;                          /* Times it was asked for again */
+    int held;                           /* Entries of have[] set */
+    uint8_t have[REORDER_LEN];          /* HELD_* of the frames after last, by seq % REORDER_LEN */
+    struct frame frames[REORDER_LEN];
+};
+static struct seq_lane lanes[SEQ_LANES];
+static struct frame link_out; /* Acks and nacks not yet sent to the server */
+static int link_count;
+
+/* Output of a receiver thread, written to stdout at once after each burst */
+struct writer {
+    char buf[WRITER_LEN];
+    size_t len;
+};
+
+void print_main_menu(void)
+{
+    printf("\n'B'roadcast message\n");
+    printf("'P'rivate message\n");
+    printf("'J'oin channel\n");
+    printf("'L'eave channel\n");
+    printf("'C'hannel message\n");
+    printf("'E'xit\n");
+    return;
+}
+
+static void custom_signal_handler(int signalNumber);
+
+static void
+remember_peer(const char *name, uint32_t id)
+{
+    int i;
+
+    pthread_mutex_lock(&peers_lock);
+    i = 0;
+    while (i < PEER_CACHE && strcmp(peers[i].user_name, name) != 0)
+    {
+        i++;
+    }
+    if (i == PEER_CACHE)
+    {
+        i = next_peer;
+        next_peer = (next_peer + 1) % PEER_CACHE;
+        snprintf(peers[i].user_name, USER_NAME_LEN, "%s", name);
+    }
+    peers[i].id = id;
+    pthread_mutex_unlock(&peers_lock);
+}
+
+/* Return the session id of a user, SESSION_NONE if we do not know it */
+static uint32_t
+lookup_peer(const char *name)
+{
+    uint32_t id = SESSION_NONE;
+
+    pthread_mutex_lock(&peers_lock);
+    for (int i = 0; i < PEER_CACHE; i++)
+    {
+        if (peers[i].id != SESSION_NONE && strcmp(peers[i].user_name, name) == 0)
+        {
+            id = peers[i].id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&peers_lock);
+    return id;
+}
+
+static void
+forget_peer(uint32_t id)
+{
+    pthread_mutex_lock(&peers_lock);
+    for (int i = 0; i < PEER_CACHE; i++)
+    {
+        if (peers[i].id == id)
+        {
+            peers[i].id = SESSION_NONE;
+        }
+    }
+    pthread_mutex_unlock(&peers_lock);
+}
+
+/* Write out what a receiver thread has buffered */
+static void
+writer_flush(struct writer *w)
+{
+    if (w->len == 0)
+    {
+        return;
+    }
+    flockfile(stdout); /* Keep the burst together and after anything main printed */
+    fwrite(w->buf, 1, w->len, stdout);
+    fflush(stdout);
+    funlockfile(stdout);
+    w->len = 0;
+}
+
+static void
+writer_printf(struct writer *w, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    if (WRITER_LEN - w->len < WRITER_LINE_MAX)
+    {
+        writer_flush(w);
+    }
+    va_start(args, format);
+    n = vsnprintf(w->buf + w->len, WRITER_LEN - w->len, format, args);
+    va_end(args);
+    if (n > 0 && (size_t)n >= WRITER_LEN - w->len)
+    {
+        /* Longer than the buffer holds, such as a long message: write what is buffered, then the line */
+        writer_flush(w);
+        flockfile(stdout);
+        va_start(args, format);
+        vfprintf(stdout, format, args);
+        va_end(args);
+        fflush(stdout);
+        funlockfile(stdout);
+    }
+    else if (n > 0)
+    {
+        w->len += n;
+    }
+}
+
+/* Make text fit on one headless output line */
+static void
+flatten(char *text)
+{
+    size_t len = strlen(text);
+
+    if (len > 0 && text[len - 1] == '\n')
+    {
+        text[--len] = '\0';
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] == '\n' || text[i] == '\t')
+        {
+            text[i] = ' ';
+        }
+    }
+}
+
+/* Add a fragment of a long message to its reassembly. Returns the whole
+ * text, for the caller to free, once the last fragment is in.
+ */
+static char *
+reassemble(uint32_t sender, const struct msg_fragment *frag, const char *data, size_t len, struct writer *out)
+{
+    struct reassembly *r = NULL;
+    struct reassembly *oldest = &reassembly[0];
+    char *text = NULL;
+
+    pthread_mutex_lock(&reassembly_lock);
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++)
+    {
+        if (reassembly[i].sender == sender && reassembly[i].id == frag->id)
+        {
+            r = &reassembly[i];
+            break;
+        }
+        if (reassembly[i].sender == SESSION_NONE ||
+            (oldest->sender != SESSION_NONE && reassembly[i].age < oldest->age))
+        {
+            oldest = &reassembly[i];
+        }
+    }
+
+    if (r == NULL)
+    {
+        if (frag->offset != 0)
+        {
+            goto out; /* The start was dropped or pushed out, so was the message */
+        }
+        r = oldest;
+        if (r->sender != SESSION_NONE)
+        {
+            free(r->text);
+            writer_printf(out, headless ? "MISSED\t1\n" : "[A long message was cut off]\n");
+        }
+        r->text = malloc(frag->total + 1);
+        if (r->text == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        r->sender = sender;
+        r->id = frag->id;
+        r->total = frag->total;
+        r->received = 0;
+        r->age = reassembly_age++;
+    }
+
+    if (frag->offset != r->received || frag->total != r->total || len > r->total - r->received)
+    {
+        /* A fragment went missing, such as one dropped for a slow consumer */
+        free(r->text);
+        r->sender = SESSION_NONE;
+        writer_printf(out, headless ? "MISSED\t1\n" : "[A long message was cut off]\n");
+        goto out;
+    }
+    memcpy(r->text + r->received, data, len);
+    r->received += len;
+    if (r->received == r->total)
+    {
+        text = r->text;
+        text[r->total] = '\0';
+        r->sender = SESSION_NONE;
+    }
+out:
+    pthread_mutex_unlock(&reassembly_lock);
+    return text;
+}
+
+/* Format a frame received from the server into a receiver's output */
+static void
+print_frame(struct frame *f, struct writer *out)
+{
+    char sender_name[USER_NAME_LEN];
+    char channel_name[USER_NAME_LEN];
+    char text[FRAME_MAX];
+    struct msg_fragment frag;
+    uint8_t type = f->u.hdr.type & ~MSG_FRAGMENT;
+    char *body;
+
+    if (frame_get_fragment(f, &frag) == -1)
+    {
+        return;
+    }
+    switch (type)
+    {
+    case MSG_HEARTBEAT:
+        break; /* Only there to update last_heard */
+
+    case MSG_JOIN_ACK:
+        __atomic_store_n(&session_id, f->u.hdr.target, __ATOMIC_RELEASE);
+        if (headless)
+        {
+            writer_printf(out, "JOINED\t%u\n", f->u.hdr.target);
+        }
+        break;
+
+    case MSG_NOTICE:
+        if (f->u.hdr.target != SESSION_NONE)
+        {
+            forget_peer(f->u.hdr.target); /* The notice is about a user that is gone */
+        }
+        frame_get_text(f, text, sizeof(text));
+        if (headless)
+        {
+            flatten(text);
+            writer_printf(out, "NOTICE\t%s\n", text);
+        }
+        else
+        {
+            writer_printf(out, "Server: %s\n", text);
+        }
+        break;
+
+    case MSG_BROADCAST:
+    case MSG_PRIVATE:
+    case MSG_CHANNEL_POST:
+        if (frame_get_str(f, sender_name) == -1 ||
+            (type == MSG_CHANNEL_POST && frame_get_str(f, channel_name) == -1))
+        {
+            break;
+        }
+        remember_peer(sender_name, f->u.hdr.sender);
+        body = text;
+        if (frag.total != 0)
+        {
+            body = reassemble(f->u.hdr.sender, &frag, frame_payload(f) + f->pos, f->u.hdr.len - f->pos, out);
+            if (body == NULL)
+            {
+                break; /* More to come */
+            }
+        }
+        else
+        {
+            frame_get_text(f, text, sizeof(text));
+        }
+
+        if (headless)
+        {
+            flatten(body);
+        }
+        if (type == MSG_CHANNEL_POST)
+        {
+            writer_printf(out, headless ? "C\t%s\t%s\t%s\n" : "[#%s] %s: %s\n", channel_name, sender_name, body);
+        }
+        else if (headless)
+        {
+            writer_printf(out, "%c\t%s\t%s\n", type == MSG_PRIVATE ? 'P' : 'B', sender_name, body);
+        }
+        else
+        {
+            writer_printf(out, "%s: %s\n", sender_name, body);
+        }
+        if (body != text)
+        {
+            free(body);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Count the shards of the server. The shard queues are numbered from 0, so
+ * count them until one is missing.
+ */
+static int
+count_shards(void)
+{
+    char server_name[MESSAGE_LEN];
+    int num_shards = 1;
+    mqd_t mqd;
+
+    while (num_shards < SHARD_MAX)
+    {
+        shard_server_name(server_name, sizeof(server_name), num_shards);
+        mqd = mq_open(server_name, O_WRONLY);
+        if (mqd == (mqd_t)-1)
+        {
+            break;
+        }
+        mq_close(mqd);
+        num_shards++;
+    }
+    return num_shards;
+}
+
+/* Open the server MQ of the shard owning a user name */
+static mqd_t
+open_server(const char *user_name)
+{
+    char server_name[MESSAGE_LEN];
+
+    shard_server_name(server_name, sizeof(server_name), shard_of(user_name, count_shards()));
+    return mq_open(server_name, O_WRONLY);
+}
+
+/* Connect to the socket of the shard owning a user name. Returns -1 on failure. */
+static int
+connect_server(const char *user_name)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    int fd;
+
+    len = shard_socket_addr(&addr, shard_of(user_name, count_shards()));
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Send a frame to the server with the given mq priority, exit if the server is gone */
+static void
+send_frame(mqd_t mqd_server, struct frame *f, unsigned int prio)
+{
+    if (server_sock != -1)
+    {
+        /* Frames go out in order on a socket, so there is no priority to give */
+        if (send(server_sock, f->u.buf, frame_size(f), MSG_NOSIGNAL) == -1)
+        {
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (mq_send(mqd_server, f->u.buf, frame_size(f), prio) == -1)
+    {
+        perror("mq_send");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(&last_sent, time(NULL), __ATOMIC_RELAXED);
+}
+
+/* Send whatever is in the outbox, as a plain frame if there is only one */
+static void
+flush_outbox(mqd_t mqd_server)
+{
+    struct frame single;
+
+    if (outbox_count == 1)
+    {
+        frame_batch_next(&outbox, &single);
+        send_frame(mqd_server, &single, frame_priority(single.u.hdr.type));
+    }
+    else if (outbox_count > 1)
+    {
+        send_frame(mqd_server, &outbox, outbox_prio);
+    }
+    frame_init(&outbox, MSG_FRAME_BATCH, session_id);
+    outbox_count = 0;
+    outbox_prio = PRIO_BULK;
+}
+
+/* Add a frame to the outbox, sending the outbox first if it is full or holds
+ * frames of another priority
+ */
+static void
+queue_frame(mqd_t mqd_server, struct frame *f)
+{
+    unsigned int prio = frame_priority(f->u.hdr.type);
+
+    if (outbox_count > 0 && prio != outbox_prio)
+    {
+        flush_outbox(mqd_server);
+    }
+    if (frame_batch_add(&outbox, f->u.buf, frame_size(f)) == -1)
+    {
+        flush_outbox(mqd_server);
+        frame_batch_add(&outbox, f->u.buf, frame_size(f));
+    }
+    outbox_count++;
+    outbox_prio = prio;
+}
+
+/* Flush the outbox unless more input is already waiting to be read */
+static void
+flush_if_idle(mqd_t mqd_server)
+{
+    struct pollfd pfd;
+
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) <= 0)
+    {
+        flush_outbox(mqd_server);
+    }
+}
+
+/* Send a join frame, the only one that carries our name */
+static void
+send_join(mqd_t mqd_server, const char *user_name)
+{
+    struct frame f;
+
+    frame_init(&f, MSG_JOIN, SESSION_NONE);
+    frame_put_str(&f, user_name);
+    frame_put_u32(&f, getpid());
+    send_frame(mqd_server, &f, PRIO_CONTROL);
+}
+
+/* Send a leave or heartbeat frame */
+static void
+send_control(mqd_t mqd_server, uint8_t type)
+{
+    struct frame f;
+
+    if (type == MSG_LEAVE)
+    {
+        __atomic_store_n(&leaving, 1, __ATOMIC_RELAXED);
+    }
+    frame_init(&f, type, session_id);
+    send_frame(mqd_server, &f, PRIO_CONTROL);
+}
+
+/* Queue a chat message with an optional name (recipient or channel) ahead of
+ * the text. A text too long for one frame, cut to MESSAGE_MAX, goes as
+ * fragments that each repeat the name.
+ */
+static void
+queue_message(uint8_t type, uint32_t target, const char *name, const char *text)
+{
+    struct frame f;
+    size_t len = strlen(text);
+    size_t offset = 0;
+    size_t slice;
+
+    if (len <= FRAGMENT_TEXT_MAX)
+    {
+        frame_init(&f, type, session_id);
+        f.u.hdr.target = target;
+        if (name != NULL)
+        {
+            frame_put_str(&f, name);
+        }
+        frame_put_text(&f, text, len);
+        queue_frame(mqd_server, &f);
+        return;
+    }
+
+    if (len > MESSAGE_MAX)
+    {
+        len = MESSAGE_MAX;
+    }
+    next_message_id++;
+    while (offset < len)
+    {
+        slice = len - offset < FRAGMENT_TEXT_MAX ? len - offset : FRAGMENT_TEXT_MAX;
+        frame_init(&f, type, session_id);
+        f.u.hdr.target = target;
+        frame_put_fragment(&f, next_message_id, len, offset);
+        if (name != NULL)
+        {
+            frame_put_str(&f, name);
+        }
+        frame_put_text(&f, text + offset, slice);
+        queue_frame(mqd_server, &f);
+        offset += slice;
+    }
+}
+
+/* Queue a broadcast */
+static void
+queue_broadcast(const char *text)
+{
+    queue_message(MSG_BROADCAST, SESSION_NONE, NULL, text);
+}
+
+/* Queue a private message, by session id if we know the recipient's */
+static void
+queue_private(const char *recipient, const char *text)
+{
+    uint32_t target = lookup_peer(recipient);
+
+    /* Without the id, let the server look the name up */
+    queue_message(MSG_PRIVATE, target, target == SESSION_NONE ? recipient : NULL, text);
+}
+
+/* Queue a channel join or leave, or a post to the channel if text is not NULL */
+static void
+queue_channel(uint8_t type, const char *channel, const char *text)
+{
+    queue_message(type, SESSION_NONE, channel, text != NULL ? text : "");
+}
+
+/* Note that the server was heard from and answer with a heartbeat if we have been quiet */
+static void
+keepalive(void)
+{
+    __atomic_store_n(&last_heard, time(NULL), __ATOMIC_RELAXED);
+
+    /* Let the server know we are still here if we have been quiet */
+    if (time(NULL) - __atomic_load_n(&last_sent, __ATOMIC_RELAXED) >= HEARTBEAT_INTERVAL)
+    {
+        send_control(mqd_server, MSG_HEARTBEAT);
+    }
+}
+
+static int64_t
+now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Send the acks and nacks collected during a burst, as a plain frame if there is only one */
+static void
+flush_link(void)
+{
+    struct frame single;
+
+    if (link_count == 1)
+    {
+        frame_batch_next(&link_out, &single);
+        send_frame(mqd_server, &single, PRIO_CONTROL);
+    }
+    else if (link_count > 1)
+    {
+        send_frame(mqd_server, &link_out, PRIO_CONTROL);
+    }
+    link_count = 0;
+}
+
+/* Add an ack or nack to those sent to the server after the burst */
+static void
+queue_link(struct frame *f)
+{
+    if (link_count > 0 && frame_batch_add(&link_out, f->u.buf, frame_size(f)) == 0)
+    {
+        link_count++;
+        return;
+    }
+    flush_link();
+    frame_init(&link_out, MSG_FRAME_BATCH, f->u.hdr.sender);
+    frame_batch_add(&link_out, f->u.buf, frame_size(f));
+    link_count = 1;
+}
+
+/* Tell the server what has arrived in order in every lane */
+static void
+queue_ack(void)
+{
+    struct frame f;
+
+    frame_init(&f, MSG_ACK, __atomic_load_n(&session_id, __ATOMIC_ACQUIRE));
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        frame_put_u32(&f, lanes[lane].last);
+        lanes[lane].acked = lanes[lane].last;
+    }
+    queue_link(&f);
+}
+
+/* Ask the server for frames first to last of a lane again */
+static void
+queue_nack(int lane, uint32_t first, uint32_t last)
+{
+    struct frame f;
+
+    frame_init(&f, MSG_NACK, __atomic_load_n(&session_id, __ATOMIC_ACQUIRE));
+    frame_put_u32(&f, lane);
+    frame_put_u32(&f, first);
+    frame_put_u32(&f, last - first + 1);
+    queue_link(&f);
+}
+
+static void
+note_missed(uint32_t missed, struct writer *out)
+{
+    if (missed > 0)
+    {
+        writer_printf(out, headless ? "MISSED\t%u\n" : "[%u messages missed]\n", missed);
+    }
+}
+
+/* Move on to the next frame of a lane, which restarts the wait for the one after */
+static void
+advance(struct seq_lane *l)
+{
+    l->last++;
+    l->tries = 0;
+    l->gap_ms = now_ms();
+}
+
+/* Print the held frames that are next in order, noting those that are gone */
+static void
+release(struct seq_lane *l, struct writer *out)
+{
+    uint32_t missed = 0;
+    int i;
+
+    while (l->held > 0 && l->have[i = (l->last + 1) % REORDER_LEN] != 0)
+    {
+        if (l->have[i] == HELD_FRAME)
+        {
+            note_missed(missed, out);
+            missed = 0;
+            print_frame(&l->frames[i], out);
+        }
+        else
+        {
+            missed++;
+        }
+        l->have[i] = 0;
+        l->held--;
+        advance(l);
+    }
+    note_missed(missed, out);
+}
+
+/* Stop waiting for the frames missing after last and go on with what follows them */
+static void
+skip_gap(struct seq_lane *l, struct writer *out)
+{
+    uint32_t missed = 0;
+
+    while (l->last < l->highest && l->have[(l->last + 1) % REORDER_LEN] == 0)
+    {
+        advance(l);
+        missed++;
+    }
+    note_missed(missed, out);
+    release(l, out);
+}
+
+/* Frame seq of a lane arrived. Ask again for those between the highest
+ * known and it, which the server dropped since the lane keeps its order.
+ */
+static void
+note_sent(int lane, uint32_t seq)
+{
+    struct seq_lane *l = &lanes[lane];
+
+    if (seq <= l->highest)
+    {
+        return;
+    }
+    if (seq - 1 > l->highest)
+    {
+        if (l->last == l->highest)
+        {
+            l->gap_ms = now_ms(); /* Start waiting */
+        }
+        queue_nack(lane, l->highest + 1, seq - 1);
+    }
+    l->highest = seq;
+}
+
+/* Print a numbered frame once every frame before it in its lane is in */
+static void
+put_in_order(int lane, struct frame *f, struct writer *out)
+{
+    struct seq_lane *l = &lanes[lane];
+    uint32_t seq = f->u.hdr.seq;
+    int i;
+
+    if (seq <= l->last)
+    {
+        return; /* Sent again after all, or given up */
+    }
+    note_sent(lane, seq);
+
+    /* Make room to hold it by giving up on the oldest gaps */
+    while (seq - l->last > REORDER_LEN)
+    {
+        skip_gap(l, out);
+    }
+    if (seq == l->last + 1)
+    {
+        print_frame(f, out);
+        advance(l);
+        release(l, out);
+        return;
+    }
+    i = seq % REORDER_LEN;
+    if (l->have[i] == 0)
+    {
+        l->frames[i] = *f;
+        l->have[i] = HELD_FRAME;
+        l->held++;
+    }
+}
+
+/* The server no longer has count frames of a lane from first on */
+static void
+mark_lost(int lane, uint32_t first, uint32_t count, struct writer *out)
+{
+    struct seq_lane *l = &lanes[lane];
+    int i;
+
+    for (uint32_t seq = first; seq - first < count && seq <= l->highest; seq++)
+    {
+        if (seq <= l->last)
+        {
+            continue;
+        }
+        if (seq - l->last > REORDER_LEN)
+        {
+            break; /* Given up later, when there is room to note it */
+        }
+        i = seq % REORDER_LEN;
+        if (l->have[i] == 0)
+        {
+            l->have[i] = HELD_LOST;
+            l->held++;
+        }
+    }
+    release(l, out);
+}
+
+/* The server tells how far it has numbered each lane and wants to know what arrived */
+static void
+sync_lanes(struct frame *f)
+{
+    struct seq_lane *l;
+    uint32_t seq;
+    int ack = 0;
+
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        if (frame_get_u32(f, &seq) == -1)
+        {
+            return;
+        }
+        l = &lanes[lane];
+        if (seq < l->highest)
+        {
+            /* Fewer than we have seen: a new server took over and numbers from the start */
+            memset(l, 0, sizeof(*l));
+            l->last = l->highest = l->acked = seq;
+            continue;
+        }
+        /* The frames it counts may still be on their way behind it, so
+         * only wait for them; check_lanes() asks if they do not come
+         */
+        if (seq > l->highest)
+        {
+            if (l->last == l->highest)
+            {
+                l->gap_ms = now_ms();
+            }
+            l->highest = seq;
+        }
+        ack |= l->last != l->acked;
+    }
+    if (ack)
+    {
+        queue_ack();
+    }
+}
+
+/* After a burst: ask again for frames missing too long, acknowledge what
+ * arrived, and send it all to the server
+ */
+static void
+check_lanes(struct writer *out)
+{
+    struct seq_lane *l;
+    int64_t now = now_ms();
+    uint32_t end;
+    int ack = 0;
+
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        l = &lanes[lane];
+        if (l->last < l->highest && now - l->gap_ms >= GAP_TIMEOUT_MS)
+        {
+            if (l->tries < NACK_TRIES)
+            {
+                /* Only the first gap; the ones after it are not due yet */
+                end = l->last + 1;
+                while (end < l->highest && end - l->last < REORDER_LEN && l->have[(end + 1) % REORDER_LEN] == 0)
+                {
+                    end++;
+                }
+                queue_nack(lane, l->last + 1, end);
+                l->tries++;
+                l->gap_ms = now;
+            }
+            else
+            {
+                skip_gap(l, out);
+            }
+        }
+        ack |= l->last - l->acked >= ACK_EVERY;
+    }
+    if (ack)
+    {
+        queue_ack();
+    }
+    if (__atomic_load_n(&session_id, __ATOMIC_ACQUIRE) == SESSION_NONE)
+    {
+        link_count = 0; /* Not joined yet, the server would not know us */
+    }
+    flush_link();
+}
 
-void print_main_menu(void)
+/* Milliseconds until check_lanes() is due to ask for a missing frame again, -1 if nothing is missing */
+static int
+gap_timeout(void)
 {
-    printf("\n'B'roadcast message\n");
-    printf("'P'rivate message\n");
-    printf("'E'xit\n");
-    return;
+    int64_t now = now_ms();
+    int64_t wait;
+    int timeout = -1;
+
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        if (lanes[lane].last < lanes[lane].highest)
+        {
+            wait = lanes[lane].gap_ms + GAP_TIMEOUT_MS - now;
+            wait = wait < 0 ? 0 : wait;
+            if (timeout == -1 || wait < timeout)
+            {
+                timeout = (int)wait;
+            }
+        }
+    }
+    return timeout;
 }
 
-static void setup_notification(mqd_t *mqdp);
-static void custom_signal_handler(int signalNumber);
+/* Take a frame from the server link: unpack a batch, put numbered frames in
+ * order and handle the acks and nacks of the server
+ */
+static void
+receive_frame(struct frame *f, struct writer *out)
+{
+    struct frame batched;
+    uint32_t lane, first, count;
+
+    switch (f->u.hdr.type)
+    {
+    case MSG_FRAME_BATCH:
+        while (frame_batch_next(f, &batched) == 0)
+        {
+            receive_frame(&batched, out);
+        }
+        break;
+
+    case MSG_ACK:
+        sync_lanes(f);
+        break;
+
+    case MSG_NACK:
+        if (frame_get_u32(f, &lane) == 0 && frame_get_u32(f, &first) == 0 && frame_get_u32(f, &count) == 0 &&
+            lane < SEQ_LANES)
+        {
+            mark_lost(lane, first, count, out);
+        }
+        break;
+
+    default:
+        if (f->u.hdr.seq != 0 && frame_priority(f->u.hdr.type) < SEQ_LANES)
+        {
+            put_in_order(frame_priority(f->u.hdr.type), f, out);
+        }
+        else
+        {
+            print_frame(f, out);
+        }
+        break;
+    }
+}
 
-static void thread_func(union sigval sv)
+/* Print every frame waiting from the server, on the connection or the
+ * client MQ, and write them out together. Returns -1 if the server closed
+ * the connection.
+ */
+static int
+receive_waiting(mqd_t mqd, struct frame *msg_buffer, struct writer *out)
 {
+    struct timespec now = {0, 0}; /* Already past: do not wait once the queue is empty */
     ssize_t nr;
-    mqd_t *mqdp;
-    void *msg_buffer;
-    struct server_msg *buffer;
-    struct mq_attr attr;
 
-    mqdp = sv.sival_ptr;
-
-    if (mq_getattr(*mqdp, &attr) == -1)
+    while ((nr = server_sock != -1 ? recv(server_sock, msg_buffer->u.buf, FRAME_MAX, MSG_DONTWAIT)
+                                   : mq_timedreceive(mqd, msg_buffer->u.buf, FRAME_MAX, NULL, &now)) > 0)
     {
-        perror("mq_getattr");
-        exit(EXIT_FAILURE);
+        if (frame_check(msg_buffer, nr) == 0)
+        {
+            receive_frame(msg_buffer, out);
+        }
     }
+    check_lanes(out);
+    writer_flush(out);
+    keepalive();
+    return nr == 0 ? -1 : 0;
+}
+
+/* Print frames from the client MQ for the life of the client */
+static void *
+mq_reader(void *arg)
+{
+    mqd_t mqd = *(mqd_t *)arg;
+    struct frame msg_buffer;
+    struct writer out;
+    struct timespec deadline;
+    ssize_t nr;
+    int timeout;
 
-    msg_buffer = malloc(attr.mq_msgsize);
-    if (msg_buffer == NULL)
+    out.len = 0;
+    while (1)
     {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+        /* Wake up in time to ask again for a missing frame */
+        timeout = gap_timeout();
+        if (timeout < 0)
+        {
+            nr = mq_receive(mqd, msg_buffer.u.buf, FRAME_MAX, NULL);
+        }
+        else
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout / 1000;
+            deadline.tv_nsec += (timeout % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            nr = mq_timedreceive(mqd, msg_buffer.u.buf, FRAME_MAX, NULL, &deadline);
+        }
+        if (nr == -1)
+        {
+            if (errno == ETIMEDOUT)
+            {
+                check_lanes(&out);
+                writer_flush(&out);
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("mq_receive");
+            return NULL;
+        }
+
+        /* Take everything else that is waiting before writing anything */
+        if (frame_check(&msg_buffer, nr) == 0)
+        {
+            receive_frame(&msg_buffer, &out);
+        }
+        receive_waiting(mqd, &msg_buffer, &out);
     }
+    return NULL;
+}
 
-    /* Reenable notification */
-    setup_notification(mqdp);
+/* Print frames from the server connection until it closes */
+static void *
+socket_reader(void *arg)
+{
+    struct frame msg_buffer;
+    struct writer out;
+    struct pollfd pfd;
+    ssize_t nr;
 
-    /* Drain the queue empty */
-    while ((nr = mq_receive(*mqdp, msg_buffer, attr.mq_msgsize, NULL)) >= 0)
+    out.len = 0;
+    pfd.fd = server_sock;
+    pfd.events = POLLIN;
+    while (1)
     {
-        buffer = (struct server_msg *)msg_buffer;
-        if (strcmp(buffer->sender_name, SERVER_NAME) != 0)
-        { /* Print if not null message and not heartbeart */
-            printf("%s: %s\n", buffer->sender_name, buffer->msg);
+        /* Wake up in time to ask again for a missing frame */
+        if (poll(&pfd, 1, gap_timeout()) == 0)
+        {
+            check_lanes(&out);
+            writer_flush(&out);
+            continue;
         }
-        else if (strcmp(buffer->sender_name, SERVER_NAME) == 0)
+        nr = recv(server_sock, msg_buffer.u.buf, FRAME_MAX, 0);
+        if (nr <= 0)
         {
-            time(&start_t); /* Keep track of heartbeat message */
+            break;
+        }
+        if (frame_check(&msg_buffer, nr) == 0)
+        {
+            receive_frame(&msg_buffer, &out);
+        }
+        if (receive_waiting((mqd_t)-1, &msg_buffer, &out) == -1)
+        {
+            break;
         }
     }
-    free(msg_buffer);
 
-    return;
+    /* Server is gone, have the watchdog give up now */
+    if (!__atomic_load_n(&leaving, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&last_heard, 0, __ATOMIC_RELAXED);
+        kill(getpid(), SIGALRM);
+    }
+    return NULL;
 }
 
+/* Start a thread with every signal blocked, since the handlers siglongjmp into main */
 static void
-setup_notification(mqd_t *mqdp)
+start_thread(void *(*func)(void *), void *arg)
 {
-    struct sigevent sev;
-
-    sev.sigev_notify = SIGEV_THREAD; /* Notify via thread */
-    sev.sigev_notify_function = thread_func;
-    sev.sigev_notify_attributes = NULL;
-    sev.sigev_value.sival_ptr = mqdp; /* Argument to thread_func() */
+    pthread_t thread;
+    sigset_t all, old;
 
-    if (mq_notify(*mqdp, &sev) == -1)
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, func, arg) != 0)
     {
-        perror("mq_notify");
+        perror("pthread_create");
         exit(EXIT_FAILURE);
     }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(thread);
+}
 
-    return;
+/* Print broadcasts from the shared-memory ring, sleeping on the ring futex when caught up */
+static void *
+ring_reader(void *arg)
+{
+    struct ring_entry entry;
+    struct frame f;
+    struct writer out;
+    uint32_t dropped;
+    pid_t my_pid = getpid();
+
+    out.len = 0;
+    while (1)
+    {
+        dropped = 0;
+        while (bcast_ring_read(ring, &ring_cursor, &entry, &dropped))
+        {
+            memcpy(f.u.buf, entry.data, entry.len);
+            if (entry.sender_pid != my_pid && frame_check(&f, entry.len) == 0) /* Skip our own broadcasts */
+            {
+                print_frame(&f, &out);
+            }
+        }
+        if (dropped > 0)
+        {
+            writer_printf(&out, headless ? "MISSED\t%u\n" : "[%u broadcasts missed]\n", dropped);
+        }
+        writer_flush(&out);
+        __atomic_store_n(&last_heard, time(NULL), __ATOMIC_RELAXED);
+        bcast_ring_wait(ring, ring_cursor);
+    }
+    return NULL;
 }
 
 static void
-mq_terminate(mqd_t mqd, char *client_name, struct client_msg msg)
+mq_terminate(mqd_t mqd, char *client_name)
 {
-    printf("Chat client exiting\n");
+    if (!headless)
+    {
+        printf("Chat client exiting\n");
+    }
+    fflush(stdout);
+    if (mqd == (mqd_t)-1)
+    {
+        exit(EXIT_SUCCESS); /* On a socket, nothing to clean up */
+    }
     /* Client MQ cleanup */
     if (mq_close(mqd) == (mqd_t)-1)
     {
@@ -125,30 +1278,213 @@ mq_terminate(mqd_t mqd, char *client_name, struct client_msg msg)
     exit(EXIT_SUCCESS);
 }
 
+/* Run one headless command line */
+static void
+run_command(mqd_t mqd, char *client_name, char *line)
+{
+    char *arg, *text;
+
+    /* Split into the command, a first argument and the text after it */
+    arg = line + (line[0] != '\0');
+    arg += strspn(arg, " ");
+    text = arg + strcspn(arg, " ");
+    if (*text != '\0' && (line[0] == 'P' || line[0] == 'C'))
+    {
+        *text++ = '\0';
+    }
+
+    switch (line[0])
+    {
+    case '\0':
+        break;
+
+    case 'B':
+        queue_broadcast(arg);
+        break;
+
+    case 'P':
+        queue_private(arg, text);
+        break;
+
+    case 'J':
+    case 'L':
+        queue_channel(line[0] == 'J' ? MSG_CHANNEL_JOIN : MSG_CHANNEL_LEAVE, arg, NULL);
+        break;
+
+    case 'C':
+        queue_channel(MSG_CHANNEL_POST, arg, text);
+        break;
+
+    case 'E':
+        flush_outbox(mqd_server);
+        send_control(mqd_server, MSG_LEAVE);
+        mq_terminate(mqd, client_name);
+
+    default:
+        fprintf(stderr, "Unknown command: %s\n", line);
+        break;
+    }
+}
+
+/* Headless client: wait on stdin, the server and the heartbeat timer in one
+ * poll. Commands are read once the join is acknowledged and sent in batches
+ * of whatever one read() returned.
+ */
+static void
+run_headless(mqd_t mqd, char *client_name)
+{
+    static char input[COMMAND_BUF + 1]; /* Room for a '\0' after a last line without newline */
+    struct frame msg_buffer;
+    struct writer out;
+    struct itimerspec heartbeat;
+    struct pollfd pfds[3];
+    uint64_t expirations;
+    size_t input_len = 0;
+    char *line, *end;
+    ssize_t nr;
+    int joined = 0;
+    int timerfd;
+    int nfds;
+
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd == -1)
+    {
+        perror("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+    heartbeat.it_value.tv_sec = HEARTBEAT_INTERVAL;
+    heartbeat.it_value.tv_nsec = 0;
+    heartbeat.it_interval = heartbeat.it_value;
+    if (timerfd_settime(timerfd, 0, &heartbeat, NULL) == -1)
+    {
+        perror("timerfd_settime");
+        exit(EXIT_FAILURE);
+    }
+
+    out.len = 0;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = server_sock != -1 ? server_sock : (int)mqd; /* On Linux an mqd_t is a pollable descriptor */
+    pfds[1].events = POLLIN;
+    pfds[2].fd = timerfd;
+    pfds[2].events = POLLIN;
+
+    while (1)
+    {
+        /* Commands need our session id. Wake up in time to ask again for a missing frame. */
+        pfds[0].fd = joined ? STDIN_FILENO : -1;
+        nfds = poll(pfds, 3, gap_timeout());
+        if (nfds == 0)
+        {
+            check_lanes(&out);
+            writer_flush(&out);
+            continue;
+        }
+        if (nfds == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pfds[1].revents != 0)
+        {
+            if (receive_waiting(mqd, &msg_buffer, &out) == -1 && !leaving)
+            {
+                printf("LOST\n");
+                mq_terminate(mqd, client_name);
+            }
+            if (!joined && session_id != SESSION_NONE)
+            {
+                frame_init(&outbox, MSG_FRAME_BATCH, session_id);
+                joined = 1;
+            }
+        }
+
+        if (pfds[2].revents != 0 && read(timerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        {
+            /* Nothing heard from the server for HEARTBEAT_MISSES intervals */
+            if (time(NULL) - last_heard > HEARTBEAT_INTERVAL * HEARTBEAT_MISSES)
+            {
+                printf("LOST\n");
+                mq_terminate(mqd, client_name);
+            }
+            if (joined && time(NULL) - last_sent >= HEARTBEAT_INTERVAL)
+            {
+                send_control(mqd_server, MSG_HEARTBEAT);
+            }
+        }
+
+        if (pfds[0].fd != -1 && pfds[0].revents != 0)
+        {
+            nr = read(STDIN_FILENO, input + input_len, COMMAND_BUF - input_len);
+            if (nr > 0)
+            {
+                input_len += nr;
+            }
+            line = input;
+            while ((end = memchr(line, '\n', input + input_len - line)) != NULL)
+            {
+                *end = '\0';
+                run_command(mqd, client_name, line);
+                line = end + 1;
+            }
+            input_len -= line - input;
+            memmove(input, line, input_len); /* Keep the incomplete last line */
+
+            if (nr <= 0)
+            {
+                /* End of the commands, run what is left and leave */
+                input[input_len] = '\0';
+                run_command(mqd, client_name, input);
+                flush_outbox(mqd_server);
+                send_control(mqd_server, MSG_LEAVE);
+                mq_terminate(mqd, client_name);
+            }
+            if (input_len == COMMAND_BUF)
+            {
+                fprintf(stderr, "Command too long\n");
+                input_len = 0;
+            }
+            flush_outbox(mqd_server);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
-    char user_name[USER_NAME_LEN];
-    /* Time tracking */
-    time_t end_t;
-    time(&start_t);
-    time(&end_t);
+    int use_socket = 0;
+    int opt;
 
-    if (argc != 2)
+    while ((opt = getopt(argc, argv, "uH")) != -1)
+    {
+        if (opt == 'u')
+        {
+            use_socket = 1;
+        }
+        else if (opt == 'H')
+        {
+            headless = 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (opt != -1 || optind != argc - 1)
     {
-        printf("Usage: %s user-name\n", argv[0]);
+        printf("Usage: %s [-u] [-H] user-name\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    strcpy(user_name, argv[1]); /* Get the client user name */
+    snprintf(user_name, sizeof(user_name), "%s", argv[optind]); /* Get the client user name */
 
-    struct client_msg msg;
-    msg.client_pid = getpid();
-    strcpy(msg.user_name, user_name);
     char option, dummy;
     char recipient[USER_NAME_LEN];
-    char message[MESSAGE_LEN];
-    msg.control = 1;
-    msg.broadcast = 2; /* default broadcast value to skip broadcast switch statement */
+    char channel[USER_NAME_LEN];
+    static char message[MESSAGE_MAX + 1];
 
     /* Client MQs */
     int flags;
@@ -159,87 +1495,143 @@ int main(int argc, char **argv)
 
     /* Set the default message queue attributes. */
     attr.mq_maxmsg = 10;           /* Maximum number of messages on queue */
-    attr.mq_msgsize = sizeof(msg); /* Maximum message size in bytes */
+    attr.mq_msgsize = FRAME_MAX;   /* Maximum message size in bytes */
     flags = O_RDWR;                /* Create or open the queue for reading and writing */
-    flags |= O_CREAT;
-    flags |= O_NONBLOCK;
+    flags |= O_CREAT;              /* Blocking: the receiver thread waits in mq_receive */
 
     perms = S_IRUSR | S_IWUSR; /* rw------- permissions on the queue */
     snprintf(client_name, MESSAGE_LEN, "/hdp38_njs76_client_%s", (char *)user_name);
-    mqd = mq_open(client_name, flags, perms, &attr);
-    if (mqd == (mqd_t)-1)
+    mqd = (mqd_t)-1;
+    if (use_socket)
     {
-        perror("mq_open");
-        exit(EXIT_FAILURE);
+        /* Everything from the server arrives on the connection */
+        server_sock = connect_server(user_name);
+        if (server_sock == -1)
+        {
+            perror("Server does not exist");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        mqd = mq_open(client_name, flags, perms, &attr);
+        if (mqd == (mqd_t)-1)
+        {
+            perror("mq_open");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Receive for as long as the client runs; headless, the main loop does */
+        if (!headless)
+        {
+            start_thread(mq_reader, &mqd);
+        }
     }
 
-    /* Set up notification */
-    setup_notification(&mqd);
+    /* Use the broadcast ring if the server has one. Start from its current
+     * head so only broadcasts sent after we join are shown.
+     */
+    ring = bcast_ring_attach(RING_NAME);
+    if (ring != NULL)
+    {
+        ring_cursor = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        start_thread(ring_reader, NULL);
+    }
 
     /* Handle signal */
     signal(SIGINT, custom_signal_handler);
     signal(SIGQUIT, custom_signal_handler);
     signal(SIGUSR1, custom_signal_handler);
+    signal(SIGUSR2, custom_signal_handler);
 
-    mqd_t mqd_server;
-    printf("User %s connecting to server\n", user_name);
-    mqd_server = mq_open(SERVER_NAME, O_WRONLY);
-    if (mqd_server == (mqd_t)-1)
+    /* The watchdog fires every interval, so keep its handler installed and
+     * let reads from stdin carry on across it.
+     */
+    struct sigaction watchdog;
+    watchdog.sa_handler = custom_signal_handler;
+    watchdog.sa_flags = SA_RESTART;
+    sigemptyset(&watchdog.sa_mask);
+    sigaction(SIGALRM, &watchdog, NULL);
+
+    if (!headless)
     {
-        perror("Server does not exist");
-        mq_terminate(mqd, client_name, msg);
-        exit(EXIT_FAILURE);
+        printf("User %s connecting to server\n", user_name);
     }
-
-    /* Operational menu for client */
-    if (mq_send(mqd_server, (char *)&msg, sizeof(msg), 0) == -1)
+    if (use_socket)
     {
-        perror("mq_send");
+        mqd_server = (mqd_t)-1;
+        if (!headless)
+        {
+            start_thread(socket_reader, NULL);
+        }
+    }
+    else if ((mqd_server = open_server(user_name)) == (mqd_t)-1)
+    {
+        perror("Server does not exist");
+        mq_terminate(mqd, client_name);
         exit(EXIT_FAILURE);
     }
 
+    /* Operational menu for client */
     int ret;
     ret = sigsetjmp(env, 1);
     /* Switch statement for sigsetjmp */
     switch (ret)
     {
     case 0:
+        /* Join only once the handlers can jump here; on a socket the server may answer at once */
+        send_join(mqd_server, user_name);
+        time(&last_heard);
+        if (!headless)
+        {
+            alarm(HEARTBEAT_INTERVAL); /* Start the server watchdog; headless polls its own timer */
+        }
         break;
 
     case FULL:
         /* Server is full */
-        msg.control = 0;
-        msg.broadcast = 2;
         /* Let server know we will leave and not try to enter */
-        if (mq_send(mqd_server, (char *)&msg, sizeof(msg), 0) == -1)
-        {
-            perror("mq_send");
-            exit(EXIT_FAILURE);
-        }
-        printf("Server is full.\n");
-        mq_terminate(mqd, client_name, msg);
+        send_control(mqd_server, MSG_LEAVE);
+        printf(headless ? "FULL\n" : "Server is full.\n");
+        mq_terminate(mqd, client_name);
 
     case KILL:
         /* Terminate client MQ and let server know we are leaving */
-        msg.control = 0;
-        msg.broadcast = 2;
-        if (mq_send(mqd_server, (char *)&msg, sizeof(msg), 0) == -1)
-        {
-            perror("mq_send");
-            exit(EXIT_FAILURE);
-        }
-        mq_terminate(mqd, client_name, msg);
+        send_control(mqd_server, MSG_LEAVE);
+        mq_terminate(mqd, client_name);
+        break;
+
+    case TAKEN:
+        /* Another client has our name. Its MQ has our name too, so leave it be. */
+        printf(headless ? "TAKEN\n" : "Name is already in use.\n");
+        fflush(stdout);
+        exit(EXIT_FAILURE);
+
+    case LOST:
+        /* Nothing heard from the server for HEARTBEAT_MISSES intervals */
+        printf(headless ? "LOST\n" : "Server not found.\n");
+        mq_terminate(mqd, client_name);
         break;
 
     default:
         break;
     }
 
-    msg.control = 2; /* default control value to skip control switch statement */
+    if (headless)
+    {
+        run_headless(mqd, client_name);
+    }
+
     sleep(1);        /* Wait for response from server if is kill */
+    /* Wait for our session id; the watchdog gives up if the server never answers */
+    while (__atomic_load_n(&session_id, __ATOMIC_ACQUIRE) == SESSION_NONE)
+    {
+        nanosleep(&(struct timespec){0, 10000000}, NULL);
+    }
+    frame_init(&outbox, MSG_FRAME_BATCH, session_id);
 
-    while (difftime(end_t, start_t) <= 5.1)
-    { /* add some time for processes to get heartbeat */
+    while (1)
+    {
         print_main_menu();
         option = getchar();
         /* Read dummy character to consume the \n left behind in STDIN */
@@ -252,78 +1644,86 @@ int main(int argc, char **argv)
         {
         case 'B':
             /* FIXME: Send message to server to be broadcast */
-            msg.broadcast = 1; /* Let server know we want to broadcast */
             printf("Message to broadcast (Ctrl-D with empty message to cancel operation): ");
 
             /* Cancel if empty with Ctrl-D */
-            if (fgets(message, MESSAGE_LEN, stdin) == NULL)
+            if (fgets(message, sizeof(message), stdin) == NULL)
             {
                 printf("\nOperation cancelled\n");
                 break;
             };
 
-            /* Copy message over to struct and send to server */
-            snprintf(msg.msg, sizeof(msg.msg), "%s", message);
-            if (mq_send(mqd_server, (const char *)&msg, sizeof(msg), 0) == -1)
-            {
-                perror("mq_send");
-                exit(EXIT_FAILURE);
-            }
-            msg.broadcast = 2;
+            /* Let server know we want to broadcast */
+            queue_broadcast(message);
             break;
 
         case 'P':
             /* FIXME: Get name of private user and send the private 
                  * message to server to be sent to private user */
-            msg.broadcast = 0; /* Let server know we want to send private message */
             printf("Username of recipient (Ctrl-D with empty message to cancel operation): ");
             if (fgets(recipient, USER_NAME_LEN, stdin) == NULL)
             {
                 printf("Invalid User\n");
                 break;
             };
-            //recipient[strcspn(recipient, "\n")] = 0;
+            recipient[strcspn(recipient, "\n")] = 0;
 
             printf("Message to user (Ctrl-D with empty message to cancel operation): ");
-            if (fgets(message, MESSAGE_LEN, stdin) == NULL)
+            if (fgets(message, sizeof(message), stdin) == NULL)
             {
                 printf("Operation cancelled\n");
                 break;
             };
             //message[strcspn(message, "\n")] = 0;
 
-            /* Copy message and recipient name over to struct and send to server */
-            snprintf(msg.msg, sizeof(msg.msg), "%s", message);
-            snprintf(msg.priv_user_name, sizeof(msg.priv_user_name), "%s", recipient);
-            if (mq_send(mqd_server, (char *)&msg, sizeof(msg), 0) == -1)
+            /* Let server know we want to send private message */
+            queue_private(recipient, message);
+            break;
+
+        case 'J':
+        case 'L':
+            printf("Channel name (Ctrl-D with empty message to cancel operation): ");
+            if (fgets(channel, USER_NAME_LEN, stdin) == NULL)
             {
-                perror("mq_send");
-                exit(EXIT_FAILURE);
-            }
-            msg.broadcast = 2;
+                printf("Operation cancelled\n");
+                break;
+            };
+            channel[strcspn(channel, "\n")] = 0;
+
+            queue_channel(option == 'J' ? MSG_CHANNEL_JOIN : MSG_CHANNEL_LEAVE, channel, NULL);
+            break;
+
+        case 'C':
+            printf("Channel name (Ctrl-D with empty message to cancel operation): ");
+            if (fgets(channel, USER_NAME_LEN, stdin) == NULL)
+            {
+                printf("Operation cancelled\n");
+                break;
+            };
+            channel[strcspn(channel, "\n")] = 0;
+
+            printf("Message to channel (Ctrl-D with empty message to cancel operation): ");
+            if (fgets(message, sizeof(message), stdin) == NULL)
+            {
+                printf("Operation cancelled\n");
+                break;
+            };
+
+            /* Only the subscribers of the channel get it */
+            queue_channel(MSG_CHANNEL_POST, channel, message);
             break;
 
         case 'E':
             /* Let server know we are leaving and terminate client MQ */
-            msg.control = 0;
-            msg.broadcast = 2;
-            if (mq_send(mqd_server, (char *)&msg, sizeof(msg), 0) == -1)
-            {
-                perror("mq_send");
-                exit(EXIT_FAILURE);
-            }
-            mq_terminate(mqd, client_name, msg);
+            flush_outbox(mqd_server);
+            send_control(mqd_server, MSG_LEAVE);
+            mq_terminate(mqd, client_name);
         default:
             printf("Unknown option\n");
             break;
         }
-        time(&end_t); /* get time after loop to compare with heartbeat */
+        flush_if_idle(mqd_server);
     }
-
-    /* Exit loop if heartbeat not heard for more than 5 seconds */
-    printf("Server not found.\n");
-    mq_terminate(mqd, client_name, msg);
-    exit(EXIT_FAILURE); /* Should only return here if client did not shut down gracefully/successfully */
 }
 
 static void
@@ -343,6 +1743,19 @@ custom_signal_handler(int signalNumber)
         siglongjmp(env, FULL);
         break;
 
+    case SIGUSR2:
+        siglongjmp(env, TAKEN);
+        break;
+
+    case SIGALRM:
+        /* Server watchdog */
+        if (time(NULL) - __atomic_load_n(&last_heard, __ATOMIC_RELAXED) > HEARTBEAT_INTERVAL * HEARTBEAT_MISSES)
+        {
+            siglongjmp(env, LOST);
+        }
+        alarm(HEARTBEAT_INTERVAL);
+        break;
+
     default:
         break;
     }
@@ -0,0 +1,498 @@
+/* Replay a trace recorded by the chat server with -T.
+ *
+ * Compile as follows: gcc -o chat_replay chat_replay.c trace.c -std=c99 -Wall -lrt -lpthread
+ *
+ * Usage: chat_replay [-f] [-u] [-m max-clients] [-d drain-ms] trace-file
+ *
+ *   -f  Send as fast as possible instead of at the recorded pacing
+ *   -u  Clients talk to the server over its Unix-domain socket
+ *   -m  Most users the trace may have (default 1024)
+ *   -d  Milliseconds to keep receiving after the last frame (default 1000)
+ *
+ * Every user that joins in the trace becomes a synthetic client of this
+ * process, a sink that only counts what it receives. The recorded frames are
+ * sent in order from their client with the session ids of the trace mapped
+ * onto the ones the running server hands out. Each join waits for its
+ * acknowledgement before going on, so every run sends the same frames in the
+ * same order. Start the server with -b 0 -P 0 to replay faster than its rate
+ * limits allow. With -f a leave can overtake deliveries still queued for the
+ * user, so fewer messages may arrive than at the recorded pacing. The acks
+ * and nacks of the recorded clients are left out; the sinks send none.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+
+#define _GNU_SOURCE // For clock_gettime(), getopt() and MSG_NOSIGNAL
+#define DEFAULT_MAX_SINKS 1024
+#define DEFAULT_DRAIN_MS 1000
+#define JOIN_TIMEOUT_MS 2000
+#define MAX_EVENTS 64
+
+#include <mqueue.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "msg_structure.h"
+#include "trace.h"
+
+/* Synthetic client standing in for one user of the trace */
+struct sink {
+    char user_name[USER_NAME_LEN];
+    char mq_name[MESSAGE_LEN];
+    mqd_t mqd;                          /* Client MQ, -1 on a socket */
+    mqd_t mqd_server;                   /* Server MQ of the shard owning the user */
+    int sock;                           /* Connection to the server with -u, -1 otherwise */
+    uint32_t id;                        /* Session id from the server, SESSION_NONE while not joined */
+};
+
+/* What the replay sent and the sinks got */
+struct replay_stats {
+    unsigned long sent[MSG_CHANNEL_POST + 1]; /* By frame type */
+    unsigned long skipped;              /* Frames of sessions that never joined in the trace */
+    unsigned long received;             /* Broadcasts, private messages and channel posts */
+    unsigned long notices;
+};
+
+static struct sink *sinks;
+static int num_sinks;
+static int max_sinks;
+/* Session ids of the trace, mapped to sinks by open addressing */
+static uint32_t *map_ids;
+static int *map_sinks;
+static unsigned int map_mask;
+static int use_socket;
+static int num_shards;
+static int epfd;
+static struct replay_stats stats;
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count the shards of the server. The shard queues are numbered from 0, so
+ * count them until one is missing.
+ */
+static int
+count_shards(void)
+{
+    char server_name[MESSAGE_LEN];
+    int n = 1;
+    mqd_t mqd;
+
+    while (n < SHARD_MAX)
+    {
+        shard_server_name(server_name, sizeof(server_name), n);
+        mqd = mq_open(server_name, O_WRONLY);
+        if (mqd == (mqd_t)-1)
+        {
+            break;
+        }
+        mq_close(mqd);
+        n++;
+    }
+    return n;
+}
+
+/* Remember which sink a session id of the trace belongs to */
+static void
+map_add(uint32_t trace_id, int sink)
+{
+    unsigned int i = (trace_id * 2654435761u) & map_mask;
+
+    while (map_ids[i] != SESSION_NONE && map_ids[i] != trace_id)
+    {
+        i = (i + 1) & map_mask;
+    }
+    map_ids[i] = trace_id;
+    map_sinks[i] = sink;
+}
+
+/* Return the sink of a session id of the trace, -1 if it never joined */
+static int
+map_find(uint32_t trace_id)
+{
+    unsigned int i = (trace_id * 2654435761u) & map_mask;
+
+    while (map_ids[i] != SESSION_NONE)
+    {
+        if (map_ids[i] == trace_id)
+        {
+            return map_sinks[i];
+        }
+        i = (i + 1) & map_mask;
+    }
+    return -1;
+}
+
+/* Find the sink of a user, creating it on the user's first join */
+static int
+find_sink(const char *user_name)
+{
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+    struct mq_attr attr;
+    struct sink *sink;
+    char server_name[MESSAGE_LEN];
+    int shard;
+
+    for (int i = 0; i < num_sinks; i++)
+    {
+        if (strcmp(sinks[i].user_name, user_name) == 0)
+        {
+            return i;
+        }
+    }
+    if (num_sinks == max_sinks)
+    {
+        fprintf(stderr, "More than %d users in the trace, use -m\n", max_sinks);
+        exit(EXIT_FAILURE);
+    }
+
+    sink = &sinks[num_sinks];
+    snprintf(sink->user_name, sizeof(sink->user_name), "%s", user_name);
+    sink->id = SESSION_NONE;
+    sink->mqd = sink->mqd_server = (mqd_t)-1;
+    sink->sock = -1;
+    shard = shard_of(user_name, num_shards);
+    if (use_socket)
+    {
+        sink->sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (sink->sock == -1 ||
+            connect(sink->sock, (struct sockaddr *)&addr, shard_socket_addr(&addr, shard)) == -1)
+        {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        snprintf(sink->mq_name, sizeof(sink->mq_name), "/hdp38_njs76_client_%s", user_name);
+        attr.mq_maxmsg = 10;
+        attr.mq_msgsize = FRAME_MAX;
+        mq_unlink(sink->mq_name);
+        sink->mqd = mq_open(sink->mq_name, O_RDONLY | O_CREAT | O_NONBLOCK, S_IRUSR | S_IWUSR, &attr);
+        shard_server_name(server_name, sizeof(server_name), shard);
+        sink->mqd_server = mq_open(server_name, O_WRONLY);
+        if (sink->mqd == (mqd_t)-1 || sink->mqd_server == (mqd_t)-1)
+        {
+            perror("mq_open");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* On Linux an mqd_t is a descriptor epoll can watch */
+    ev.events = EPOLLIN;
+    ev.data.u64 = num_sinks;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, use_socket ? sink->sock : (int)sink->mqd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    return num_sinks++;
+}
+
+static void
+send_frame(struct sink *sink, struct frame *f)
+{
+    if (sink->sock != -1)
+    {
+        if (send(sink->sock, f->u.buf, frame_size(f), MSG_NOSIGNAL) == -1)
+        {
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (mq_send(sink->mqd_server, f->u.buf, frame_size(f), frame_priority(f->u.hdr.type)) == -1)
+    {
+        perror("mq_send");
+        exit(EXIT_FAILURE);
+    }
+    if ((f->u.hdr.type & ~MSG_FRAGMENT) <= MSG_CHANNEL_POST)
+    {
+        stats.sent[f->u.hdr.type & ~MSG_FRAGMENT]++;
+    }
+}
+
+/* Account for one frame delivered to a sink */
+static void
+record_frame(struct sink *sink, struct frame *f)
+{
+    struct frame batched;
+    struct msg_fragment frag;
+
+    if (frame_get_fragment(f, &frag) == -1)
+    {
+        return;
+    }
+    switch (f->u.hdr.type & ~MSG_FRAGMENT)
+    {
+    case MSG_FRAME_BATCH:
+        while (frame_batch_next(f, &batched) == 0)
+        {
+            record_frame(sink, &batched);
+        }
+        break;
+
+    case MSG_JOIN_ACK:
+        sink->id = f->u.hdr.target;
+        break;
+
+    case MSG_NOTICE:
+        stats.notices++;
+        break;
+
+    case MSG_BROADCAST:
+    case MSG_PRIVATE:
+    case MSG_CHANNEL_POST:
+        if (frag.offset == 0) /* A long message counts once */
+        {
+            stats.received++;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Receive what is waiting for the sinks, waiting up to timeout_ms for something to arrive */
+static void
+pump(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct frame f;
+    struct sink *sink;
+    ssize_t nr;
+    int nfds;
+
+    nfds = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < nfds; i++)
+    {
+        sink = &sinks[events[i].data.u64];
+        while ((nr = sink->sock != -1 ? recv(sink->sock, f.u.buf, FRAME_MAX, MSG_DONTWAIT)
+                                      : mq_receive(sink->mqd, f.u.buf, FRAME_MAX, NULL)) > 0)
+        {
+            if (frame_check(&f, nr) == 0)
+            {
+                record_frame(sink, &f);
+            }
+        }
+        if (nr == 0)
+        {
+            /* Server closed the connection */
+            epoll_ctl(epfd, EPOLL_CTL_DEL, sink->sock, NULL);
+            close(sink->sock);
+            sink->sock = -1;
+            sink->id = SESSION_NONE;
+        }
+    }
+}
+
+/* Send a recorded join from the sink of the user, as this process, and wait for its session id */
+static void
+replay_join(const struct trace_record *rec, struct frame *in)
+{
+    char user_name[USER_NAME_LEN];
+    struct frame f;
+    struct sink *sink;
+    int64_t deadline;
+    int s;
+
+    if (frame_get_str(in, user_name) == -1)
+    {
+        return;
+    }
+    s = find_sink(user_name);
+    sink = &sinks[s];
+    sink->id = SESSION_NONE;
+    frame_init(&f, MSG_JOIN, SESSION_NONE);
+    frame_put_str(&f, user_name);
+    frame_put_u32(&f, getpid()); /* The server watches this process instead of the recorded one */
+    send_frame(sink, &f);
+
+    deadline = now_ns() + (int64_t)JOIN_TIMEOUT_MS * 1000000;
+    while (sink->id == SESSION_NONE)
+    {
+        if (now_ns() > deadline)
+        {
+            fprintf(stderr, "%s: no join acknowledgement\n", user_name);
+            exit(EXIT_FAILURE);
+        }
+        pump(10);
+    }
+    map_add(rec->session, s);
+}
+
+/* Send a recorded frame from the sink it belongs to, with the ids of today */
+static void
+replay_frame(const struct trace_record *rec, struct frame *f)
+{
+    struct sink *sink;
+    int target;
+    int s;
+
+    if (f->u.hdr.type == MSG_ACK || f->u.hdr.type == MSG_NACK)
+    {
+        return; /* About the deliveries of the recorded run, not of this one */
+    }
+    s = map_find(rec->session);
+    if (s < 0 || sinks[s].id == SESSION_NONE)
+    {
+        stats.skipped++;
+        return;
+    }
+    sink = &sinks[s];
+    f->u.hdr.sender = sink->id;
+    if (f->u.hdr.target != SESSION_NONE)
+    {
+        /* A recipient that is gone keeps the stale id and gets a notice, as it did then */
+        target = map_find(f->u.hdr.target);
+        if (target >= 0 && sinks[target].id != SESSION_NONE)
+        {
+            f->u.hdr.target = sinks[target].id;
+        }
+    }
+    send_frame(sink, f);
+    if (f->u.hdr.type == MSG_LEAVE)
+    {
+        sink->id = SESSION_NONE;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct trace trace;
+    struct trace_record rec;
+    struct frame f;
+    unsigned long total = 0;
+    int64_t start, due, end;
+    int fast = 0;
+    int drain_ms = DEFAULT_DRAIN_MS;
+    unsigned int map_size;
+    int r;
+    int opt;
+
+    max_sinks = DEFAULT_MAX_SINKS;
+    while ((opt = getopt(argc, argv, "fum:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            fast = 1;
+            break;
+        case 'u':
+            use_socket = 1;
+            break;
+        case 'm':
+            max_sinks = atoi(optarg);
+            break;
+        case 'd':
+            drain_ms = atoi(optarg);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || max_sinks <= 0)
+    {
+        printf("Usage: %s [-f] [-u] [-m max-clients] [-d drain-ms] trace-file\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (trace_open(&trace, argv[optind]) == -1)
+    {
+        fprintf(stderr, "%s is not a trace of this chat version\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Every join names our pid; a full server would tell us with SIGUSR1 */
+    signal(SIGUSR1, SIG_IGN);
+    num_shards = count_shards();
+    sinks = calloc(max_sinks, sizeof(struct sink));
+    for (map_size = 4; map_size < 4 * (unsigned int)max_sinks; map_size *= 2)
+    {
+        ;
+    }
+    map_mask = map_size - 1;
+    map_ids = calloc(map_size, sizeof(uint32_t)); /* SESSION_NONE is 0 */
+    map_sinks = calloc(map_size, sizeof(int));
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sinks == NULL || map_ids == NULL || map_sinks == NULL || epfd == -1)
+    {
+        perror("setup");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now_ns();
+    while ((r = trace_read(&trace, &rec, &f)) == 1)
+    {
+        /* Keep the recorded gaps, receiving while waiting */
+        due = start + (int64_t)rec.time_ns;
+        while (!fast && now_ns() < due)
+        {
+            pump((int)((due - now_ns() + 999999) / 1000000));
+        }
+
+        if (f.u.hdr.type == MSG_JOIN)
+        {
+            replay_join(&rec, &f);
+        }
+        else
+        {
+            replay_frame(&rec, &f);
+        }
+        total++;
+        pump(0);
+    }
+    if (r == -1)
+    {
+        fprintf(stderr, "Trace damaged after %lu frames\n", total);
+    }
+    end = now_ns();
+    trace_close(&trace);
+
+    /* Let the server finish delivering, then leave */
+    for (int64_t until = now_ns() + (int64_t)drain_ms * 1000000; now_ns() < until;)
+    {
+        pump(10);
+    }
+    for (int i = 0; i < num_sinks; i++)
+    {
+        if (sinks[i].id != SESSION_NONE)
+        {
+            frame_init(&f, MSG_LEAVE, sinks[i].id);
+            send_frame(&sinks[i], &f);
+        }
+        if (sinks[i].mqd != (mqd_t)-1)
+        {
+            mq_close(sinks[i].mqd);
+            mq_close(sinks[i].mqd_server);
+            mq_unlink(sinks[i].mq_name);
+        }
+        if (sinks[i].sock != -1)
+        {
+            close(sinks[i].sock);
+        }
+    }
+
+    printf("replayed    %lu frames from %d users in %.3f s (%.1f frames/s)%s\n", total, num_sinks,
+           (end - start) / 1e9, total / ((end - start) / 1e9 + 1e-9), fast ? ", as fast as possible" : "");
+    printf("sent        %lu joins, %lu broadcasts, %lu private, %lu channel posts, %lu leaves\n",
+           stats.sent[MSG_JOIN], stats.sent[MSG_BROADCAST], stats.sent[MSG_PRIVATE],
+           stats.sent[MSG_CHANNEL_POST], stats.sent[MSG_LEAVE]);
+    printf("skipped     %lu frames of unknown sessions\n", stats.skipped);
+    printf("received    %lu messages, %lu server notices\n", stats.received, stats.notices);
+    exit(EXIT_SUCCESS);
+}
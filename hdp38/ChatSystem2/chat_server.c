@@ -1,6 +1,59 @@
 /* Skeleton code for the server side code. 
  * 
- * Compile as follows: gcc -o hdp38_njs76_chat_server chat_server.c -std=c99 -Wall -lrt
+ * Compile as follows: gcc -o hdp38_njs76_chat_server chat_server.c registry.c channel.c fanout.c bcast_ring.c offline.c shard.c ratelimit.c trace.c metrics.c -std=c99 -Wall -lrt -lpthread
+ *
+ * Usage: hdp38_njs76_chat_server [-m max-clients] [-w fanout-workers] [-r]
+ *                                [-q queue-len] [-p drop|coalesce|disconnect] [-t threshold]
+ *                                [-C max-channels] [-o offline-dir] [-k shards] [-u]
+ *                                [-b broadcasts/s] [-P privates/s] [-A max-pending]
+ *                                [-T trace-file] [-L max-message] [-R resend-len]
+ *
+ *   -r  Publish broadcasts through the shared-memory ring (see bcast_ring.c)
+ *   -q  Messages held per client while its MQ is full (default 64)
+ *   -p  What to do when that queue is full: drop the oldest message (default),
+ *       replace the backlog with a "missed N messages" notice, or drop new
+ *       messages and disconnect the client after -t drops (default 128)
+ *   -C  Number of channels that can exist at once (default 64)
+ *   -o  Keep private messages for users that are not connected in this
+ *       directory and deliver them when the user joins (see offline.c)
+ *   -k  Run as this many processes, each owning the users whose name hashes
+ *       to it (see shard.c). Cannot be combined with -r.
+ *   -u  Also accept clients over a Unix-domain socket, which is not bound by
+ *       the system-wide mqueue limits. Clients started with -u use it.
+ *   -b  Broadcasts and channel posts each client may send per second, with
+ *       bursts of twice that (default 100, 0 for no limit)
+ *   -P  Private messages each client may send per second (default 200)
+ *   -A  Turn chat messages away while more than this many fan-out jobs wait
+ *       for a worker (default 1024)
+ *   -T  Record every client frame the server accepts in this file, for
+ *       chat_replay (see trace.c). Shard n > 0 writes trace-file.n.
+ *   -L  Longest message text accepted, in bytes (default and at most 65536).
+ *       Text that does not fit in one frame arrives in fragments.
+ *   -R  Chat messages kept per client and lane until the client acknowledges
+ *       them, to send again if it reports one missing (default 128)
+ *
+ * A message over a limit is rejected and the sender is told with a notice,
+ * at most once a second, so one client flooding the server cannot hold up
+ * delivery to everybody else. A long message counts once, by its first
+ * fragment; the rest of it is let through if that one was, as long as it
+ * follows in order and ends where the first fragment said.
+ *
+ * Fragments are routed one by one like any other message and never
+ * reassembled here. They travel in the bulk priority lane below broadcasts,
+ * so small messages overtake a long paste on the way to every recipient.
+ *
+ * Every chat message to a client is numbered in its lane, so the client
+ * notices a gap and asks for what is missing. A message still kept is sent
+ * again; one the slow-consumer policy dropped is reported as missed. Acks and
+ * nacks from the client are handed to the worker owning it (see fanout.c),
+ * which keeps the recent messages.
+ *
+ * Send the server SIGUSR2 to print the lag counters of every client.
+ *
+ * Counters of received frames, joins, leaves and rejected messages, the
+ * fan-out size of every broadcast, the time the workers spend writing to
+ * clients and the lag of each client are kept up to date in shared memory,
+ * where chatstat reads them (see metrics.c).
  *
  * Author: Naga Kandasamy
  * Date created: January 28, 2020
@@ -12,33 +65,158 @@
  * Server will only send a message FROM the server if the server is full 
  * or if the client tries to connect with same name as server.
  * Otherwise, message "sender" is the client who originated the message. 
+ *
+ * The server is event driven: it blocks in epoll on the server MQ, a timerfd
+ * that drives the heartbeat and a signalfd for SIGINT/SIGQUIT/SIGUSR2. Delivery
+ * to the client MQs is handed to a pool of fan-out workers (see fanout.c).
+ *
+ * Each client process is also watched through a pidfd, so a client that dies
+ * without leaving is dropped at once and the MQ it left behind is unlinked.
+ *
+ * The registry is kept in shared memory (see registry.c). If the server dies
+ * without shutting down, the next one started takes over the clients that
+ * are still running and resumes delivery to them under the same session ids;
+ * the server MQ survives the crash, so they never need to reconnect. Channel
+ * subscriptions are not kept and have to be joined again.
+ *
+ * Every frame travels with the mq priority of its class (see msg_structure.h):
+ * control above private above broadcast, in both directions.
+ *
+ * A socket client sends its frames over its connection, which the server
+ * drains with recvmmsg(), and the worker owning it writes with sendmmsg().
+ * Closing the connection drops the client. Socket clients cannot be resumed
+ * after a crash since the connection dies with the server.
  */
-#define _POSIX_C_SOURCE 1
+#define _GNU_SOURCE // For epoll, timerfd and signalfd
 
-#define SERVER_NAME "/hdp38_njs76_chat_server"
-#define MAX_CLIENTS 100
-#define KILL 10
-#define HEARTBEAT 20
+#define DEFAULT_MAX_CLIENTS 100
+#define DEFAULT_FANOUT_WORKERS 2
+#define DEFAULT_QUEUE_LEN 64
+#define DEFAULT_DROP_THRESHOLD 128
+#define DEFAULT_MAX_CHANNELS 64
+#define DEFAULT_BROADCAST_RATE 100
+#define DEFAULT_PRIVATE_RATE 200
+#define DEFAULT_ADMISSION_LIMIT 1024
+#define DEFAULT_RESEND_LEN 128
+#define RATE_BURST_SECONDS 2 /* Seconds of sending a quiet client may save up */
+#define MAX_EVENTS 8
+#define RECV_BATCH 32 /* Messages drained from the server MQ per wakeup */
+#define REPLAY_BATCH 32 /* Most stored messages handed to a client per join or heartbeat */
+
+/* Event sources registered with epoll */
+#define EV_SERVER_MQ 1
+#define EV_HEARTBEAT 2
+#define EV_SIGNAL 3
+#define EV_FANOUT 4 /* A fan-out worker found a dead client */
+#define EV_SHARD 5 /* Another shard sent frames or made room for ours */
+#define EV_LISTEN 6 /* A socket client is connecting */
+#define EV_CLIENT_EXIT 16 /* EV_CLIENT_EXIT + slot: the process of that client exited */
+#define EV_CONNECTION 0x20000 /* EV_CONNECTION + fd: frames from a socket client */
 
 #include <mqueue.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include "msg_structure.h"
-#include <stdio.h>
+#include "registry.h"
+#include "channel.h"
+#include "fanout.h"
+#include "bcast_ring.h"
+#include "offline.h"
+#include "shard.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "metrics.h"
 #include <string.h>
 #include <signal.h>
-#include <setjmp.h>
+#include <poll.h>
 
-/* FIXME: Establish signal handler to handle CTRL+C signal and 
- * shut down gracefully. 
- */
-static void custom_signal_handler(int signalNumber);
-static void alarm_handler(int);
-static sigjmp_buf env;
+static void handle_client_frame(struct frame *in, int conn_fd);
+static void handle_client_msg(struct frame *in, int conn_fd);
+static void handle_shard_msg(struct shard_msg *msg);
+static void route_private(struct frame *in, const char *sender_name);
+static void deliver_broadcast(struct frame *in, const char *sender_name, int exclude_slot);
+static void deliver_post(struct frame *in, const char *sender_name, const char *channel_name, int ch, int exclude_slot);
+static void forward_to_shards(struct frame *in, const char *sender_name);
+static void send_to_session(uint32_t id, struct fanout_msg *out);
+static void send_heartbeat(void);
+static void expire_clients(void);
+static void count_event(uint64_t *counter, uint64_t n);
+static void publish_gauges(void);
+static time_t monotonic_time(void);
+static int64_t monotonic_ns(void);
+static void reset_limits(int slot);
+static int admit(int slot, struct token_bucket *bucket, const struct rate_limit *limit);
+static uint32_t fragment_slice(struct frame *in);
+static int admit_message(int slot, struct frame *in, const struct msg_fragment *frag, struct token_bucket *bucket,
+                         const struct rate_limit *limit);
+static struct fanout_msg *new_delivery(struct frame *in, uint8_t type, const char *sender_name, const char *channel_name);
+static struct fanout_msg *new_notice(const char *text, uint32_t target);
+static struct fanout_msg *new_control(uint8_t type, uint32_t target);
+static void replay_offline(int slot);
+static void replay_pending(void);
+static void resume_clients(void);
+static void reap_dead_clients(void);
+static void drop_client(struct registry *reg, int slot);
+static void watch_client(int slot);
+static void client_exited(int slot);
+static void reap_exited_client(int slot);
+static void accept_connections(int listen_fd);
+static void receive_connection(int fd);
+static void close_connection(int fd);
+static void add_event(int epfd, int fd, uint32_t source);
+
+/* Connected clients */
+static struct registry reg;
+/* Channels and their subscribers */
+static struct channel_table channels;
+/* Workers delivering to the client MQs */
+static struct fanout_pool pool;
+/* Shared-memory broadcast ring, NULL unless enabled with -r */
+static struct bcast_ring *ring;
+/* Stored private messages, NULL unless enabled with -o */
+static struct offline_store offline_store;
+static struct offline_store *offline;
+/* Stored messages replayed to a client at a time */
+static int replay_max;
+/* Links to the other shards; a single shard when not sharded */
+static struct shard_set shards;
+/* Event loop */
+static int epfd;
+
+/* Sending allowance of a client, indexed by slot */
+struct client_limits {
+    struct token_bucket broadcast;      /* Broadcasts and channel posts */
+    struct token_bucket private_msgs;
+    int64_t notified_ns;                /* When the client was last told a message was turned away */
+    uint32_t fragment_id;               /* Long message whose first fragment was admitted, 0 if none */
+    uint32_t fragment_total;            /* Bytes of that message */
+    uint32_t fragment_next;             /* Offset its next fragment must have */
+};
+static struct client_limits *limits;
+static struct rate_limit broadcast_limit;
+static struct rate_limit private_limit;
+/* Fan-out jobs allowed to wait before chat messages are turned away */
+static int admission_limit = DEFAULT_ADMISSION_LIMIT;
+/* Longest message text accepted */
+static uint32_t max_message = MESSAGE_MAX;
+/* Recording of client traffic, NULL unless enabled with -T */
+static struct trace trace_store;
+static struct trace *trace;
+/* Live counters for chatstat */
+static struct metrics metrics;
+static struct metrics_server *stats;
 
 int main(int argc, char **argv)
 {
@@ -46,303 +224,1501 @@ int main(int argc, char **argv)
     mode_t perms;
     mqd_t mqd; /* Server MQ */
     struct mq_attr attr;
-    struct client_msg msg_buffer;
-    char connected_clients[MAX_CLIENTS][USER_NAME_LEN];
-    memset(connected_clients, '\0', sizeof(connected_clients[0][0]) * MAX_CLIENTS * USER_NAME_LEN);
-
-    int alarm_interval = 5;
-    mqd_t priv_mq;      /* mq for private user */
-    mqd_t broadcast_mq; /* for broadcasts */
-    mqd_t heartbeat_mq; /* for the heartbeat */
-    struct server_msg server_buffer;
-    /* Build the dest_user mq */
-    static char dest_user_mq[MESSAGE_LEN];
-    int num_clients = 0;
-    /* Skip if client MQ crashed but client is still up */
-    int skip = 0;
-    /* Check for if client cant send */
-    int client_found = 0;
+    struct frame msg_buffer;
+    int max_clients = DEFAULT_MAX_CLIENTS;
+    int max_channels = DEFAULT_MAX_CHANNELS;
+    struct fanout_config config;
+    int use_ring = 0;
+    int resumed;
+    char *offline_dir = NULL;
+    char *trace_path = NULL;
+    char trace_name[512];
+    char offline_path[512];
+    char server_name[MESSAGE_LEN];
+    char registry_name[MESSAGE_LEN];
+    char metrics_name[MESSAGE_LEN];
+    mqd_t shard_mqds[SHARD_MAX];
+    int listen_fds[SHARD_MAX];
+    int use_sockets = 0;
+    struct sockaddr_un addr;
+    pid_t shard_pids[SHARD_MAX];
+    int num_shards = 1;
+    double broadcast_rate = DEFAULT_BROADCAST_RATE;
+    double private_rate = DEFAULT_PRIVATE_RATE;
+    int opt;
+
+    config.num_workers = DEFAULT_FANOUT_WORKERS;
+    config.queue_len = DEFAULT_QUEUE_LEN;
+    config.policy = POLICY_DROP_OLDEST;
+    config.threshold = DEFAULT_DROP_THRESHOLD;
+    config.resend_len = DEFAULT_RESEND_LEN;
+
+    while ((opt = getopt(argc, argv, "m:w:rq:p:t:C:o:k:ub:P:A:T:L:R:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            max_clients = atoi(optarg);
+            break;
+        case 'w':
+            config.num_workers = atoi(optarg);
+            break;
+        case 'r':
+            use_ring = 1;
+            break;
+        case 'q':
+            config.queue_len = atoi(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0)
+            {
+                config.policy = POLICY_DROP_OLDEST;
+            }
+            else if (strcmp(optarg, "coalesce") == 0)
+            {
+                config.policy = POLICY_COALESCE;
+            }
+            else if (strcmp(optarg, "disconnect") == 0)
+            {
+                config.policy = POLICY_DISCONNECT;
+            }
+            else
+            {
+                printf("Unknown policy %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            config.threshold = atoi(optarg);
+            break;
+        case 'C':
+            max_channels = atoi(optarg);
+            break;
+        case 'o':
+            offline_dir = optarg;
+            break;
+        case 'k':
+            num_shards = atoi(optarg);
+            break;
+        case 'u':
+            use_sockets = 1;
+            break;
+        case 'b':
+            broadcast_rate = atof(optarg);
+            break;
+        case 'P':
+            private_rate = atof(optarg);
+            break;
+        case 'A':
+            admission_limit = atoi(optarg);
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'L':
+            max_message = atoi(optarg);
+            break;
+        case 'R':
+            config.resend_len = atoi(optarg);
+            break;
+        default:
+            printf("Usage: %s [-m max-clients] [-w fanout-workers] [-r] [-q queue-len] "
+                   "[-p drop|coalesce|disconnect] [-t threshold] [-C max-channels] [-o offline-dir] "
+                   "[-k shards] [-u] [-b broadcasts/s] [-P privates/s] [-A max-pending] "
+                   "[-T trace-file] [-L max-message] [-R resend-len]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (max_clients <= 0 || max_clients > REGISTRY_MAX_CLIENTS)
+    {
+        printf("max-clients must be between 1 and %d\n", REGISTRY_MAX_CLIENTS);
+        exit(EXIT_FAILURE);
+    }
+    if (config.num_workers <= 0 || config.queue_len <= 0 || config.threshold <= 0 || max_channels <= 0 ||
+        config.resend_len <= 0)
+    {
+        printf("fanout-workers, queue-len, threshold, max-channels and resend-len must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (num_shards <= 0 || num_shards > SHARD_MAX || (num_shards > 1 && use_ring))
+    {
+        printf("shards must be between 1 and %d and cannot be combined with -r\n", SHARD_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (broadcast_rate < 0 || private_rate < 0 || admission_limit <= 0)
+    {
+        printf("rates must not be negative and max-pending must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (max_message == 0 || max_message > MESSAGE_MAX)
+    {
+        printf("max-message must be between 1 and %d\n", MESSAGE_MAX);
+        exit(EXIT_FAILURE);
+    }
+    rate_limit_init(&broadcast_limit, broadcast_rate, RATE_BURST_SECONDS);
+    rate_limit_init(&private_limit, private_rate, RATE_BURST_SECONDS);
 
     /* Set the default message queue attributes. */
     attr.mq_maxmsg = 10;                  /* Maximum number of messages on queue */
-    attr.mq_msgsize = sizeof(msg_buffer); /* Maximum message size in bytes */
+    attr.mq_msgsize = FRAME_MAX;          /* Maximum message size in bytes */
     flags = O_RDWR;                       /* Create or open the queue for reading and writing */
     flags |= O_CREAT;
-    flags |= O_NONBLOCK;
+    flags |= O_NONBLOCK;                  /* epoll tells us when to read, never block in mq_receive */
 
     perms = S_IRUSR | S_IWUSR; /* rw------- permissions on the queue */
 
-    mqd = mq_open(SERVER_NAME, flags, perms, &attr);
-    if (mqd == (mqd_t)-1)
+    /* The server MQs stay the way clients find the shards, so listen on an
+     * abstract address named after each MQ before the MQ appears. It goes
+     * away with the server.
+     */
+    for (int i = 0; i < num_shards; i++)
     {
-        perror("mq_open");
-        exit(EXIT_FAILURE);
+        listen_fds[i] = -1;
+        if (!use_sockets)
+        {
+            continue;
+        }
+        listen_fds[i] = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fds[i] == -1)
+        {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        if (bind(listen_fds[i], (struct sockaddr *)&addr, shard_socket_addr(&addr, i)) == -1 ||
+            listen(listen_fds[i], SOMAXCONN) == -1)
+        {
+            perror("bind");
+            exit(EXIT_FAILURE);
+        }
     }
-    /* Handle signals */
-    signal(SIGINT, custom_signal_handler);
-    signal(SIGQUIT, custom_signal_handler);
-    signal(SIGALRM, alarm_handler);
-
-    unsigned int priority;
-    //struct mq_attr attr;
-    ssize_t nr;
 
-    int ret;
-    ret = sigsetjmp(env, 1);
-
-    /* Switch statement for sigsetjmp */
-    switch (ret)
+    /* Clients count the shard queues, so create them all before any shard
+     * starts and remove those left by an earlier server with more shards.
+     * chatstat counts the metrics segments the same way, and the registries
+     * of those shards hold clients no shard will resume, so they go too.
+     */
+    for (int i = num_shards; i < SHARD_MAX; i++)
     {
-    case 0:
-        break;
-
-    case KILL:
-        /* Shut server down on a SIGINT or SIGQUIT signal */
-        printf("\nServer gracefully shutting down.\n");
-        if (mq_close(mqd) == (mqd_t)-1)
+        shard_server_name(server_name, sizeof(server_name), i);
+        mq_unlink(server_name);
+        metrics_shm_name(server_name, sizeof(server_name), i);
+        shm_unlink(server_name);
+        snprintf(server_name, sizeof(server_name), "%s.%d", REGISTRY_NAME, i);
+        shm_unlink(server_name);
+    }
+    for (int i = 0; i < num_shards; i++)
+    {
+        shard_server_name(server_name, sizeof(server_name), i);
+        shard_mqds[i] = mq_open(server_name, flags, perms, &attr);
+        if (shard_mqds[i] == (mqd_t)-1)
         {
-            perror("mq_close");
+            perror("mq_open");
             exit(EXIT_FAILURE);
         }
+    }
 
-        if (mq_unlink(SERVER_NAME) == (mqd_t)-1)
+    /* This process is shard 0 and forks the others */
+    if (shard_setup(&shards, num_shards) == -1)
+    {
+        perror("shard_setup");
+        exit(EXIT_FAILURE);
+    }
+    if (num_shards > 1 && offline_dir != NULL && mkdir(offline_dir, S_IRWXU) == -1 && errno != EEXIST)
+    {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < num_shards; i++)
+    {
+        shard_pids[i] = fork();
+        if (shard_pids[i] == -1)
         {
-            perror("mq_unlink");
+            perror("fork");
             exit(EXIT_FAILURE);
         }
-        exit(EXIT_SUCCESS);
-
-    case HEARTBEAT:
-        // printf("Sending a heartbeat\n");
-        /* Send message to clients to re-establish a beat */
-        for (int i = 0; i < MAX_CLIENTS; i++)
+        if (shard_pids[i] == 0)
+        {
+            shards.self = i;
+            prctl(PR_SET_PDEATHSIG, SIGINT); /* Go down with shard 0 */
+            break;
+        }
+    }
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (i != shards.self)
         {
-            if (connected_clients[i][0] != 0)
+            mq_close(shard_mqds[i]);
+            if (listen_fds[i] != -1)
             {
-                snprintf(dest_user_mq, MESSAGE_LEN, "/hdp38_njs76_client_%s", (char *)connected_clients[i]);
-                dest_user_mq[strcspn(dest_user_mq, "\n")] = 0; // remove newline from client name
-                // printf("Sending to mq : %s\n", dest_user_mq);
-                heartbeat_mq = mq_open(dest_user_mq, O_WRONLY);
+                close(listen_fds[i]);
+            }
+        }
+    }
+    mqd = shard_mqds[shards.self];
+    shard_server_name(server_name, sizeof(server_name), shards.self);
 
-                /* Open user mq and send */
-                if (heartbeat_mq == (mqd_t)-1)
-                {
-                    perror("Could not find message recipient");
-                    continue;
-                }
+    /* Client MQs are opened once at join and reused until the client leaves */
+    if (shards.self == 0)
+    {
+        snprintf(registry_name, sizeof(registry_name), "%s", REGISTRY_NAME);
+    }
+    else
+    {
+        snprintf(registry_name, sizeof(registry_name), "%s.%d", REGISTRY_NAME, shards.self);
+    }
+    resumed = registry_init(&reg, max_clients, registry_name);
+    if (resumed == -1)
+    {
+        perror("registry_init");
+        exit(EXIT_FAILURE);
+    }
+    reg.shard = shards.self;
+    limits = calloc(max_clients, sizeof(struct client_limits));
+    if (limits == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    if (channel_init(&channels, max_channels, max_clients) == -1)
+    {
+        perror("channel_init");
+        exit(EXIT_FAILURE);
+    }
 
-                strcpy(server_buffer.sender_name, SERVER_NAME); /* Send with server MQ name to distinguish where heartbeat is coming from */
-                strcpy(server_buffer.msg, "\0");
+    /* Messages stored by an earlier server are delivered by this one */
+    if (offline_dir != NULL)
+    {
+        if (num_shards > 1)
+        {
+            snprintf(offline_path, sizeof(offline_path), "%s/shard-%d", offline_dir, shards.self);
+            offline_dir = offline_path;
+        }
+        if (offline_open(&offline_store, offline_dir) == -1)
+        {
+            perror("offline_open");
+            exit(EXIT_FAILURE);
+        }
+        offline = &offline_store;
+    }
+    if (trace_path != NULL)
+    {
+        if (shards.self == 0)
+        {
+            snprintf(trace_name, sizeof(trace_name), "%s", trace_path);
+        }
+        else
+        {
+            snprintf(trace_name, sizeof(trace_name), "%s.%d", trace_path, shards.self);
+        }
+        if (trace_create(&trace_store, trace_name) == -1)
+        {
+            perror("trace_create");
+            exit(EXIT_FAILURE);
+        }
+        trace = &trace_store;
+    }
+    /* Leave half of each client queue for live traffic so the drop policy never hits replayed messages */
+    replay_max = config.queue_len / 2 > 0 ? config.queue_len / 2 : 1;
+    if (replay_max > REPLAY_BATCH)
+    {
+        replay_max = REPLAY_BATCH;
+    }
 
-                if (mq_send(heartbeat_mq, (char *)&server_buffer, sizeof(server_buffer), 0) == -1)
-                {
-                    perror("mq_send");
-                    exit(EXIT_FAILURE);
-                }
-            }
+    /* Clients look for the ring to decide how to receive broadcasts, so a
+     * ring left behind by an earlier server must not outlive it.
+     */
+    if (use_ring)
+    {
+        ring = bcast_ring_create(RING_NAME);
+        if (ring == NULL)
+        {
+            exit(EXIT_FAILURE);
         }
-        break;
+    }
+    else
+    {
+        shm_unlink(RING_NAME);
+    }
 
-    default:
-        break;
+    /* Handle SIGINT, SIGQUIT and SIGUSR2 synchronously through a signalfd.
+     * Blocked before the workers start so they inherit the mask.
+     */
+    sigset_t mask;
+    int sigfd;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGUSR2); /* Print lag counters */
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+    {
+        perror("pthread_sigmask");
+        exit(EXIT_FAILURE);
+    }
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1)
+    {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+
+    if (metrics_create(&metrics, shards.self, config.num_workers, max_clients) == -1)
+    {
+        perror("metrics_create");
+        exit(EXIT_FAILURE);
+    }
+    stats = &metrics.seg->server;
+    if (fanout_init(&pool, &config, max_clients, metrics.seg) == -1)
+    {
+        perror("fanout_init");
+        exit(EXIT_FAILURE);
     }
 
-    alarm(alarm_interval);
+    /* Periodic heartbeat timer */
+    struct itimerspec heartbeat;
+    int timerfd;
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd == -1)
+    {
+        perror("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+    heartbeat.it_value.tv_sec = HEARTBEAT_INTERVAL;
+    heartbeat.it_value.tv_nsec = 0;
+    heartbeat.it_interval = heartbeat.it_value;
+    if (timerfd_settime(timerfd, 0, &heartbeat, NULL) == -1)
+    {
+        perror("timerfd_settime");
+        exit(EXIT_FAILURE);
+    }
 
-    while (1)
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+    {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    add_event(epfd, (int)mqd, EV_SERVER_MQ); /* On Linux an mqd_t is a pollable descriptor */
+    add_event(epfd, timerfd, EV_HEARTBEAT);
+    add_event(epfd, sigfd, EV_SIGNAL);
+    add_event(epfd, pool.reap_fd, EV_FANOUT);
+    add_event(epfd, shard_wake_fd(&shards), EV_SHARD);
+    if (listen_fds[shards.self] != -1)
+    {
+        add_event(epfd, listen_fds[shards.self], EV_LISTEN);
+    }
+    if (resumed)
     {
-        /* FIXME: Server code here */
+        resume_clients();
+    }
 
-        /* Set the alarm up */
+    struct epoll_event events[MAX_EVENTS];
+    struct signalfd_siginfo siginfo;
+    struct shard_msg shard_msg;
+    uint64_t expirations;
+    unsigned int priority;
+    ssize_t nr;
+    int nfds;
+    int running = 1;
 
-        /* Get the attributes of the MQ */
-        if (mq_getattr(mqd, &attr) == -1)
+    while (running)
+    {
+        nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (nfds == -1)
         {
-            perror("mq_getattr");
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
             exit(EXIT_FAILURE);
         }
 
-        /* Allocate local buffer to store the received message from the MQ */
-        nr = mq_receive(mqd, (char *)&msg_buffer, sizeof(msg_buffer), &priority);
-        if (nr == -1)
-        {
-            //perror ("mq_receive");
-            continue;
-        }
-
-        /* Add user to the connected clients array */
-        switch (msg_buffer.control)
+        for (int i = 0; i < nfds; i++)
         {
-        case 0: /* User leaves */
-            // printf("DEBUG: User leaving\n");
-            for (int i = 0; i < MAX_CLIENTS; i++)
+            switch (events[i].data.u32)
             {
-                // printf("%s: %s\n", connected_clients[i], msg_buffer.user_name);
-                if (strcmp(connected_clients[i], msg_buffer.user_name) == 0)
+            case EV_SERVER_MQ:
+                /* Drain a bounded batch; epoll is level triggered so anything
+                 * left on the queue wakes us again after the other events.
+                 * Clients send joins and leaves at PRIO_CONTROL, so they are
+                 * received ahead of any backlog of chat messages.
+                 */
+                for (int n = 0; n < RECV_BATCH; n++)
                 {
-                    num_clients--;
-                    // printf("NumClients : %i\n", num_clients);
-                    // printf("DEBUG: The user that left was %s\n", msg_buffer.user_name);
-                    memset(&connected_clients[i], '\0', sizeof(connected_clients[i]));
-
-                    // for (int ii = 0; ii < MAX_CLIENTS; ii++) {
-                    //     printf("DEBUG: Client %i: %s\n", ii, connected_clients[ii]);
-                    // }
-                    break;
+                    nr = mq_receive(mqd, msg_buffer.u.buf, FRAME_MAX, &priority);
+                    if (nr == -1)
+                    {
+                        if (errno != EAGAIN)
+                        {
+                            perror("mq_receive");
+                        }
+                        break;
+                    }
+                    if (frame_check(&msg_buffer, nr) == -1)
+                    {
+                        continue;
+                    }
+                    handle_client_frame(&msg_buffer, -1);
                 }
-            }
-            break;
-        case 1: /* User joins */
-            // printf("DEBUG: User joins\n");
-            /* Check to see if server is full */
-            num_clients++;
-            if (num_clients > MAX_CLIENTS)
-            {
-                //printf("Server full! \nKilling client: %s\n", msg_buffer.user_name);
-                num_clients--;
-                kill(msg_buffer.client_pid, SIGUSR1); /* send client SIGUSR1 to let know that server is full */
                 break;
-            }
 
-            for (int i = 0; i < MAX_CLIENTS; i++)
-            {
-                if (connected_clients[i][0] == 0)
+            case EV_LISTEN:
+                accept_connections(listen_fds[shards.self]);
+                break;
+
+            case EV_HEARTBEAT:
+                if (read(timerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
                 {
-                    snprintf(connected_clients[i], sizeof(connected_clients[i]), "%s", msg_buffer.user_name);
-                    //printf("DEBUG: The user that joined was %s\n", connected_clients[i]);
-                    /* for (int ii = 0; ii < MAX_CLIENTS; ii++) {
-                            printf("DEBUG: Client %i: %s\n", ii, connected_clients[ii]);
-                        } */
-                    // printf("NumClients : %i\n", num_clients);
-                    break;
+                    // printf("Sending a heartbeat\n");
+                    send_heartbeat();
+                    expire_clients();
+                    replay_pending();
                 }
-            }
-            break;
-        default:
-            // printf("DEBUG: Unknown case for control: %d\n", msg_buffer.control);
-            break;
-        }
+                break;
 
-        switch (msg_buffer.broadcast)
-        {
-        case 0: /* private message */
-            /* find the user to whisper */
-            // printf("private message\n");
-            snprintf(dest_user_mq, MESSAGE_LEN, "/hdp38_njs76_client_%s", (char *)msg_buffer.priv_user_name);
-            dest_user_mq[strcspn(dest_user_mq, "\n")] = 0; // remove newline from client name
-            // printf("Opened priv_mq of : %s\n", dest_user_mq);
-            priv_mq = mq_open(dest_user_mq, O_WRONLY);
+            case EV_FANOUT:
+                reap_dead_clients();
+                break;
 
-            /* Open priv user mq and send */
-            if (priv_mq == (mqd_t)-1)
-            {
-                for (int i = 0; i < MAX_CLIENTS; i++)
+            case EV_SHARD:
+                if (read(shard_wake_fd(&shards), &expirations, sizeof(expirations)) == sizeof(expirations))
                 {
-                    if (strcmp(connected_clients[i], msg_buffer.priv_user_name) == 0)
+                    while (shard_receive(&shards, &shard_msg))
                     {
-                        memset(&connected_clients[i], '\0', sizeof(connected_clients[i])); /* remove user from list if needed */
+                        handle_shard_msg(&shard_msg);
                     }
+                    shard_retry(&shards); /* Links we were waiting on may have room now */
                 }
-                // perror("Could not find private message recipient");
-                snprintf(dest_user_mq, MESSAGE_LEN, "/hdp38_njs76_client_%s", (char *)msg_buffer.user_name);
-                priv_mq = mq_open(dest_user_mq, O_WRONLY);
-                if (priv_mq == (mqd_t)-1)
-                {
-                    perror("Could not find original user");
-                    break;
-                }
-                strcpy(server_buffer.sender_name, "Server");
-                strcpy(server_buffer.msg, "Cannot find recipient");
-                if (mq_send(priv_mq, (char *)&server_buffer, sizeof(server_buffer), 0) == -1)
+                break;
+
+            case EV_SIGNAL:
+                if (read(sigfd, &siginfo, sizeof(siginfo)) == sizeof(siginfo))
                 {
-                    perror("mq_send");
-                    // exit(EXIT_FAILURE);
-                    break;
+                    if (siginfo.ssi_signo == SIGUSR2)
+                    {
+                        fanout_report_lag(&pool);
+                    }
+                    else
+                    {
+                        running = 0;
+                    }
                 }
-                // exit (EXIT_FAILURE);
                 break;
-            }
-
-            strcpy(server_buffer.sender_name, msg_buffer.user_name);
-            strcpy(server_buffer.msg, msg_buffer.msg);
-            if (mq_send(priv_mq, (char *)&server_buffer, sizeof(server_buffer), 0) == -1)
-            {
-                perror("mq_send");
-                exit(EXIT_FAILURE);
-            }
-            /* printf("Message from %s sent to other person %s.\nContents: %s\n", server_buffer.sender_name, \
-                                                              msg_buffer.priv_user_name, server_buffer.msg); */
-
-            break;
 
-        case 1: /* broadcast message */
-            // printf("Broadcast message from %s\n", msg_buffer.user_name);
-            /* Make sure client is in list */
-            for (int i = 0; i < MAX_CLIENTS; i++)
-            {
-                if (strcmp(connected_clients[i], msg_buffer.user_name) == 0)
+            default:
+                if (events[i].data.u32 >= EV_CONNECTION)
                 {
-                    client_found = 1;
-                    break;
+                    receive_connection(events[i].data.u32 - EV_CONNECTION);
                 }
-            }
-
-            /* loop over each client that currently exists. Also ignore the client that's sending the message. */
-            if (client_found == 1)
-            {
-                for (int i = 0; i < MAX_CLIENTS; i++)
+                else if (events[i].data.u32 >= EV_CLIENT_EXIT)
                 {
-                    if (connected_clients[i][0] != 0 && strcmp(connected_clients[i], msg_buffer.user_name) != 0)
-                    {
-                        snprintf(dest_user_mq, MESSAGE_LEN, "/hdp38_njs76_client_%s", (char *)connected_clients[i]);
-                        dest_user_mq[strcspn(dest_user_mq, "\n")] = 0; // remove newline from client name
-                        // printf("Sending to mq : %s\n", dest_user_mq);
-                        broadcast_mq = mq_open(dest_user_mq, O_WRONLY);
-
-                        /* Open priv user mq and send */
-                        if (broadcast_mq == (mqd_t)-1)
-                        {
-                            perror("Could not find message recipient");
-                            memset(&connected_clients[i], '\0', sizeof(connected_clients[i])); /* clear up that spot for a new user */
-                            skip = 1;
-                        }
-
-                        strcpy(server_buffer.sender_name, msg_buffer.user_name);
-                        strcpy(server_buffer.msg, msg_buffer.msg);
-                        if (skip != 1)
-                        {
-                            if (mq_send(broadcast_mq, (char *)&server_buffer, sizeof(server_buffer), 0) == -1)
-                            {
-                                perror("mq_send");
-                                exit(EXIT_FAILURE);
-                            }
-                        }
-                        skip = 0; /* Change skip variable back to default */
-                        /* printf("Message from %s sent to other person %s.\nContents: %s\n", server_buffer.sender_name, \
-                                                                        connected_clients[i], server_buffer.msg); */
-                    }
+                    client_exited(events[i].data.u32 - EV_CLIENT_EXIT);
                 }
+                break;
             }
-            client_found = 0;
-            break;
-        default:
-            // printf("DEBUG: Unknown case for broadcast: %d\n", msg_buffer.broadcast);
-            break;
         }
+
+        /* Group commit: one flush for every message stored while handling these events */
+        if (offline != NULL)
+        {
+            offline_commit(offline);
+        }
+        publish_gauges();
+    }
+
+    /* Shut server down on a SIGINT or SIGQUIT signal */
+    if (shards.self == 0)
+    {
+        printf("\nServer gracefully shutting down.\n");
+        for (int i = 1; i < num_shards; i++)
+        {
+            kill(shard_pids[i], SIGINT);
+            waitpid(shard_pids[i], NULL, 0);
+        }
+    }
+    fanout_destroy(&pool); /* Workers close the client MQs and their copies of the connections */
+    registry_destroy(&reg);
+    shm_unlink(registry_name); /* Clients lose the server MQ too, nothing to resume */
+    channel_destroy(&channels);
+    free(limits);
+    metrics_detach(&metrics);
+    metrics_shm_name(metrics_name, sizeof(metrics_name), shards.self);
+    shm_unlink(metrics_name);
+    if (trace != NULL)
+    {
+        trace_close(trace);
+    }
+    if (offline != NULL)
+    {
+        offline_close(offline);
+    }
+    if (ring != NULL)
+    {
+        bcast_ring_detach(ring);
+        shm_unlink(RING_NAME);
+    }
+    if (listen_fds[shards.self] != -1)
+    {
+        close(listen_fds[shards.self]);
+    }
+    close(epfd);
+    close(timerfd);
+    close(sigfd);
+    if (mq_close(mqd) == (mqd_t)-1)
+    {
+        perror("mq_close");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mq_unlink(server_name) == (mqd_t)-1)
+    {
+        perror("mq_unlink");
+        exit(EXIT_FAILURE);
     }
     exit(EXIT_SUCCESS);
 }
 
+/* Process a frame received on the server MQ (conn_fd -1) or on a connection,
+ * which may be a batch of frames sent as one
+ */
+static void
+handle_client_frame(struct frame *in, int conn_fd)
+{
+    struct frame batched;
+
+    if (in->u.hdr.type == MSG_FRAME_BATCH)
+    {
+        while (frame_batch_next(in, &batched) == 0)
+        {
+            handle_client_msg(&batched, conn_fd);
+        }
+    }
+    else
+    {
+        handle_client_msg(in, conn_fd);
+    }
+}
+
+/* Process one client frame */
+static void
+handle_client_msg(struct frame *in, int conn_fd)
+{
+    struct fanout_msg *out;
+    char user_name[USER_NAME_LEN];
+    char channel_name[USER_NAME_LEN];
+    struct msg_fragment frag;
+    uint32_t client_pid;
+    uint32_t acked[SEQ_LANES];
+    uint32_t lane, first, count;
+    int ch;
+    int slot;
+    int sender_idx; /* slot of the user that sent the message */
+
+    count_event(&stats->received[(in->u.hdr.type & ~MSG_FRAGMENT) < METRICS_TYPES ? in->u.hdr.type & ~MSG_FRAGMENT : 0], 1);
+    if (in->u.hdr.type == MSG_JOIN) /* User joins */
+    {
+        // printf("DEBUG: User joins\n");
+        if (frame_get_str(in, user_name) == -1 || frame_get_u32(in, &client_pid) == -1 || (pid_t)client_pid <= 0)
+        {
+            return;
+        }
+
+        /* A client rejoining under the same name replaces its old entry. Any
+         * other process asking for a name in use is turned away, unless the
+         * one holding it has died and is not reaped yet.
+         */
+        slot = registry_find(&reg, user_name);
+        if (slot >= 0 && reg.clients[slot].client_pid != (pid_t)client_pid &&
+            (conn_fd == -1 || reg.clients[slot].conn_fd != conn_fd) &&
+            !(kill(reg.clients[slot].client_pid, 0) == -1 && errno == ESRCH))
+        {
+            kill(client_pid, SIGUSR2); /* send client SIGUSR2 to let know that the name is taken */
+            count_event(&stats->full, 1);
+            return;
+        }
+        if (slot >= 0)
+        {
+            if (reg.clients[slot].conn_fd == conn_fd)
+            {
+                reg.clients[slot].conn_fd = -1; /* Same connection, keep it open */
+            }
+            drop_client(&reg, slot);
+        }
+
+        /* Check to see if server is full */
+        slot = registry_add(&reg, user_name, client_pid);
+        if (slot < 0)
+        {
+            //printf("Server full! \nKilling client: %s\n", user_name);
+            kill(client_pid, SIGUSR1); /* send client SIGUSR1 to let know that server is full */
+            count_event(&stats->full, 1);
+            return;
+        }
+        count_event(&stats->joins, 1);
+        reg.clients[slot].last_seen = monotonic_time();
+        reg.clients[slot].conn_fd = conn_fd;
+        reset_limits(slot);
+        if (trace != NULL)
+        {
+            trace_write(trace, monotonic_ns(), registry_session_id(&reg, slot), in);
+        }
+
+        /* The owning worker opens the client MQ once and reuses it for all
+         * traffic to this client. If the open fails the client is reaped.
+         * A socket client is written through a copy of its connection.
+         * The acknowledgement tells the client the id to use from now on.
+         */
+        fanout_open(&pool, slot, reg.clients[slot].gen, user_name, conn_fd != -1 ? dup(conn_fd) : -1);
+        out = new_control(MSG_JOIN_ACK, registry_session_id(&reg, slot));
+        fanout_send(&pool, slot, out);
+        fanout_msg_put(out);
+        watch_client(slot);
+        replay_offline(slot);
+        // printf("NumClients : %i\n", reg.hdr->num_clients);
+        return;
+    }
+
+    /* Every other frame comes from a joined client and names it by session id */
+    sender_idx = registry_find_id(&reg, in->u.hdr.sender);
+    if (sender_idx < 0 || reg.clients[sender_idx].conn_fd != conn_fd) /* Only on the way it joined */
+    {
+        // printf("DEBUG: Frame of type %d from unknown session %u\n", in->u.hdr.type, in->u.hdr.sender);
+        return;
+    }
+    reg.clients[sender_idx].last_seen = monotonic_time(); /* Any frame shows the client is alive */
+    if (trace != NULL)
+    {
+        trace_write(trace, monotonic_ns(), in->u.hdr.sender, in);
+    }
+    if (frame_get_fragment(in, &frag) == -1)
+    {
+        return;
+    }
+
+    switch (in->u.hdr.type & ~MSG_FRAGMENT)
+    {
+    case MSG_HEARTBEAT: /* Client keepalive, nothing else to do */
+        break;
+
+    case MSG_LEAVE: /* User leaves */
+        // printf("DEBUG: The user that left was %s\n", reg.clients[sender_idx].user_name);
+        /* A leave overtakes the fragments still queued behind it, so a long
+         * message cut short is given up rather than finished
+         */
+        limits[sender_idx].fragment_id = 0;
+        drop_client(&reg, sender_idx);
+        break;
+
+    case MSG_ACK: /* What the client has received, lane by lane */
+        for (int lane = 0; lane < SEQ_LANES; lane++)
+        {
+            if (frame_get_u32(in, &acked[lane]) == -1)
+            {
+                return;
+            }
+        }
+        fanout_ack(&pool, sender_idx, acked);
+        break;
+
+    case MSG_NACK: /* Messages the client is missing */
+        if (frame_get_u32(in, &lane) == -1 || frame_get_u32(in, &first) == -1 ||
+            frame_get_u32(in, &count) == -1)
+        {
+            break;
+        }
+        fanout_resend(&pool, sender_idx, (int)lane, first, count);
+        break;
+
+    case MSG_PRIVATE: /* private message */
+        if (!admit_message(sender_idx, in, &frag, &limits[sender_idx].private_msgs, &private_limit))
+        {
+            break;
+        }
+        route_private(in, reg.clients[sender_idx].user_name);
+        break;
+
+    case MSG_BROADCAST: /* broadcast message */
+        // printf("Broadcast message from %s\n", reg.clients[sender_idx].user_name);
+        if (!admit_message(sender_idx, in, &frag, &limits[sender_idx].broadcast, &broadcast_limit))
+        {
+            break;
+        }
+        deliver_broadcast(in, reg.clients[sender_idx].user_name, sender_idx);
+        forward_to_shards(in, reg.clients[sender_idx].user_name);
+        break;
+
+    case MSG_CHANNEL_JOIN:
+        if (frame_get_str(in, channel_name) == -1)
+        {
+            break;
+        }
+        if (channel_subscribe(&channels, channel_name, sender_idx) < 0)
+        {
+            out = new_notice("Too many channels", SESSION_NONE);
+            fanout_send(&pool, sender_idx, out);
+            fanout_msg_put(out);
+        }
+        break;
+
+    case MSG_CHANNEL_LEAVE:
+        if (frame_get_str(in, channel_name) == -1)
+        {
+            break;
+        }
+        ch = channel_find(&channels, channel_name);
+        if (ch >= 0)
+        {
+            channel_unsubscribe(&channels, ch, sender_idx);
+        }
+        break;
+
+    case MSG_CHANNEL_POST:
+        if (frame_get_str(in, channel_name) == -1)
+        {
+            break;
+        }
+        /* Only subscribers may post */
+        ch = channel_find(&channels, channel_name);
+        if (ch < 0 || !channel_has(&channels.channels[ch], sender_idx))
+        {
+            out = new_notice("Not in channel", SESSION_NONE);
+            fanout_send(&pool, sender_idx, out);
+            fanout_msg_put(out);
+            break;
+        }
+
+        if (!admit_message(sender_idx, in, &frag, &limits[sender_idx].broadcast, &broadcast_limit))
+        {
+            break;
+        }
+        deliver_post(in, reg.clients[sender_idx].user_name, channel_name, ch, sender_idx);
+        forward_to_shards(in, reg.clients[sender_idx].user_name); /* Subscribers of other shards */
+        break;
+
+    default:
+        // printf("DEBUG: Unknown frame type: %d\n", in->u.hdr.type);
+        break;
+    }
+}
+
+/* Process a message from another shard */
+static void
+handle_shard_msg(struct shard_msg *msg)
+{
+    struct fanout_msg *out;
+    struct frame in;
+    struct msg_fragment frag;
+    char channel_name[USER_NAME_LEN];
+    int slot;
+    int ch;
+
+    memcpy(in.u.buf, msg->frame, msg->len);
+    if (frame_check(&in, msg->len) == -1)
+    {
+        return;
+    }
+
+    if (msg->kind == SHARD_DELIVER)
+    {
+        /* A server frame for one of our clients, such as a notice */
+        slot = registry_find_id(&reg, msg->target);
+        if (slot >= 0)
+        {
+            out = fanout_msg_new(in.u.buf, msg->len);
+            fanout_send(&pool, slot, out);
+            fanout_msg_put(out);
+        }
+        return;
+    }
+
+    /* A frame a client of the other shard sent, to be delivered to ours */
+    if (frame_get_fragment(&in, &frag) == -1)
+    {
+        return;
+    }
+    switch (in.u.hdr.type & ~MSG_FRAGMENT)
+    {
+    case MSG_PRIVATE:
+        route_private(&in, msg->sender_name);
+        break;
+
+    case MSG_BROADCAST:
+        deliver_broadcast(&in, msg->sender_name, -1);
+        break;
+
+    case MSG_CHANNEL_POST:
+        if (frame_get_str(&in, channel_name) == 0 && (ch = channel_find(&channels, channel_name)) >= 0)
+        {
+            deliver_post(&in, msg->sender_name, channel_name, ch, -1);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Deliver a private message, or pass it to the shard owning the recipient */
+static void
+route_private(struct frame *in, const char *sender_name)
+{
+    struct fanout_msg *out;
+    struct msg_fragment frag = {0, 0, 0};
+    char priv_user_name[USER_NAME_LEN] = "";
+    const char *name;
+    int priv_idx; /* slot of private user */
+    int shard;
+
+    if (in->u.hdr.type & MSG_FRAGMENT)
+    {
+        memcpy(&frag, frame_payload(in), sizeof(frag)); /* Leads the payload */
+    }
+
+    /* find the user to whisper, by id if the client knows it */
+    // printf("private message\n");
+    if (in->u.hdr.target != SESSION_NONE)
+    {
+        shard = SESSION_SHARD(in->u.hdr.target);
+    }
+    else if (frame_get_str(in, priv_user_name) == 0)
+    {
+        shard = shard_of(priv_user_name, shards.num_shards);
+    }
+    else
+    {
+        return;
+    }
+
+    if (shard != shards.self && shard < shards.num_shards)
+    {
+        shard_send(&shards, shard, SHARD_ROUTE, SESSION_NONE, sender_name, in->u.buf, frame_size(in));
+        return;
+    }
+
+    if (in->u.hdr.target != SESSION_NONE)
+    {
+        priv_idx = registry_find_id(&reg, in->u.hdr.target);
+        if (priv_idx < 0 && (name = registry_name_of_id(&reg, in->u.hdr.target)) != NULL)
+        {
+            /* Left since the sender learned the id: back under a new one, or offline */
+            snprintf(priv_user_name, sizeof(priv_user_name), "%s", name);
+            priv_idx = registry_find(&reg, priv_user_name);
+        }
+    }
+    else
+    {
+        priv_idx = registry_find(&reg, priv_user_name);
+    }
+
+    if (priv_idx < 0 && offline != NULL && priv_user_name[0] != '\0')
+    {
+        /* Keep it for when the recipient joins */
+        out = new_delivery(in, MSG_PRIVATE, sender_name, NULL);
+        if (offline_append(offline, priv_user_name, out->data, out->len) == 0)
+        {
+            fanout_msg_put(out);
+            if (frag.offset == 0) /* Once for a long message, not for every fragment */
+            {
+                out = new_notice("Recipient offline, message stored", SESSION_NONE);
+                send_to_session(in->u.hdr.sender, out);
+                fanout_msg_put(out);
+            }
+            return;
+        }
+        fanout_msg_put(out);
+    }
+    if (priv_idx < 0)
+    {
+        // perror("Could not find private message recipient");
+        /* Tell the sender, along with the id it should forget, once for a long message */
+        if (frag.offset == 0)
+        {
+            out = new_notice("Cannot find recipient", in->u.hdr.target);
+            send_to_session(in->u.hdr.sender, out);
+            fanout_msg_put(out);
+        }
+        return;
+    }
+
+    /* The owning worker drops the client if its queue is gone */
+    out = new_delivery(in, MSG_PRIVATE, sender_name, NULL);
+    fanout_send(&pool, priv_idx, out);
+    fanout_msg_put(out);
+    /* printf("Message from %s sent to other person %s.\n", sender_name, priv_user_name); */
+}
+
+/* Deliver a broadcast to the clients of this shard except exclude_slot (-1 for none) */
+static void
+deliver_broadcast(struct frame *in, const char *sender_name, int exclude_slot)
+{
+    struct fanout_msg *out;
+
+    out = new_delivery(in, MSG_BROADCAST, sender_name, NULL);
+    metrics_begin(&stats->seq);
+    metrics_hist_add(&stats->fanout, reg.hdr->num_clients - (exclude_slot >= 0));
+    metrics_end(&stats->seq);
+    if (ring != NULL)
+    {
+        /* Written once; clients read it from the ring and skip their own.
+         * The ring is only used by a single shard, so the sender is ours.
+         */
+        bcast_ring_publish(ring, reg.clients[exclude_slot].client_pid, out->data, out->len);
+    }
+    else
+    {
+        /* Every worker delivers to the live clients of its shard, ignoring the client that's sending the message. */
+        fanout_broadcast(&pool, out, exclude_slot);
+    }
+    fanout_msg_put(out);
+}
+
+/* Deliver a channel post to the subscribers of this shard except exclude_slot (-1 for none) */
+static void
+deliver_post(struct frame *in, const char *sender_name, const char *channel_name, int ch, int exclude_slot)
+{
+    struct fanout_msg *out;
+
+    /* Only the workers owning subscribed slots do any work */
+    out = new_delivery(in, MSG_CHANNEL_POST, sender_name, channel_name);
+    metrics_begin(&stats->seq);
+    metrics_hist_add(&stats->fanout, channels.channels[ch].num_members -
+                     (exclude_slot >= 0 && channel_has(&channels.channels[ch], exclude_slot)));
+    metrics_end(&stats->seq);
+    fanout_multicast(&pool, out, channels.channels[ch].members, channels.words, exclude_slot);
+    fanout_msg_put(out);
+}
+
+/* Hand a frame from one of our clients to every other shard */
+static void
+forward_to_shards(struct frame *in, const char *sender_name)
+{
+    for (int i = 0; i < shards.num_shards; i++)
+    {
+        if (i != shards.self)
+        {
+            shard_send(&shards, i, SHARD_ROUTE, SESSION_NONE, sender_name, in->u.buf, frame_size(in));
+        }
+    }
+}
+
+/* Send a server frame to a client of any shard */
+static void
+send_to_session(uint32_t id, struct fanout_msg *out)
+{
+    int shard = SESSION_SHARD(id);
+    int slot;
+
+    if (shard != shards.self)
+    {
+        if (shard < shards.num_shards)
+        {
+            shard_send(&shards, shard, SHARD_DELIVER, id, NULL, out->data, out->len);
+        }
+        return;
+    }
+    slot = registry_find_id(&reg, id);
+    if (slot >= 0)
+    {
+        fanout_send(&pool, slot, out);
+    }
+}
+
+/* Send message to clients to re-establish a beat */
+static void
+send_heartbeat(void)
+{
+    struct fanout_msg *out;
+
+    /* A heartbeat is a bare header, only sent to clients that got nothing else this interval */
+    out = new_control(MSG_HEARTBEAT, SESSION_NONE);
+    fanout_heartbeat(&pool, out);
+    fanout_msg_put(out);
+}
+
+/* Drop clients that have not sent anything for HEARTBEAT_MISSES intervals */
+static void
+expire_clients(void)
+{
+    time_t now = monotonic_time();
+    int slot;
+
+    /* Walk backwards so dropping a client does not skip the one swapped into its place */
+    for (int i = reg.hdr->num_clients - 1; i >= 0; i--)
+    {
+        slot = reg.live[i];
+        if (now - reg.clients[slot].last_seen > HEARTBEAT_INTERVAL * HEARTBEAT_MISSES)
+        {
+            fprintf(stderr, "Client %s timed out\n", reg.clients[slot].user_name);
+            drop_client(&reg, slot);
+        }
+    }
+}
+
+/* Add n to a counter of the server thread in the metrics segment */
+static void
+count_event(uint64_t *counter, uint64_t n)
+{
+    metrics_begin(&stats->seq);
+    *counter += n;
+    metrics_end(&stats->seq);
+}
+
+/* Publish how many clients there are and how many jobs the workers were given */
+static void
+publish_gauges(void)
+{
+    metrics_begin(&stats->seq);
+    stats->clients = reg.hdr->num_clients;
+    stats->posted = pool.posted;
+    metrics_end(&stats->seq);
+}
+
+static time_t
+monotonic_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static int64_t
+monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Give a new client full buckets */
+static void
+reset_limits(int slot)
+{
+    int64_t now = monotonic_ns();
+
+    bucket_init(&limits[slot].broadcast, &broadcast_limit, now);
+    bucket_init(&limits[slot].private_msgs, &private_limit, now);
+    limits[slot].notified_ns = now - 1000000000;
+    limits[slot].fragment_id = 0;
+}
+
+/* Decide whether a client may send one more chat message: the workers must
+ * not be too far behind and the client must be within its rate. Returns 1 if
+ * it may, otherwise tells the client unless it was told within the last second.
+ */
+static int
+admit(int slot, struct token_bucket *bucket, const struct rate_limit *limit)
+{
+    struct fanout_msg *out;
+    const char *reason = NULL;
+    int64_t now = monotonic_ns();
+
+    if (fanout_pending(&pool) > admission_limit)
+    {
+        reason = "Server busy, message rejected";
+    }
+    else if (bucket_take(bucket, limit, now) == -1)
+    {
+        reason = "Sending too fast, message rejected";
+    }
+    if (reason == NULL)
+    {
+        return 1;
+    }
+
+    count_event(&stats->rejected, 1);
+    if (now - limits[slot].notified_ns >= 1000000000)
+    {
+        out = new_notice(reason, SESSION_NONE);
+        fanout_send(&pool, slot, out);
+        fanout_msg_put(out);
+        limits[slot].notified_ns = now;
+    }
+    return 0;
+}
+
+/* Bytes of text a fragment carries, after the recipient's name of a private message sent by name */
+static uint32_t
+fragment_slice(struct frame *in)
+{
+    char name[USER_NAME_LEN];
+    size_t pos = in->pos;
+    uint32_t len = 0;
+
+    if ((in->u.hdr.type & ~MSG_FRAGMENT) != MSG_PRIVATE || in->u.hdr.target != SESSION_NONE ||
+        frame_get_str(in, name) == 0)
+    {
+        len = in->u.hdr.len - in->pos;
+    }
+    in->pos = pos;
+    return len;
+}
+
+/* admit() for a message that may be a fragment. The first fragment of a
+ * long message decides for all of it, so it is only rate limited once and
+ * never cut off halfway. The rest must follow it in order and stop at its
+ * end, so a client cannot send more than the admitted message.
+ */
+static int
+admit_message(int slot, struct frame *in, const struct msg_fragment *frag, struct token_bucket *bucket,
+              const struct rate_limit *limit)
+{
+    struct fanout_msg *out;
+    uint32_t len;
+
+    if (frag->total == 0)
+    {
+        return admit(slot, bucket, limit);
+    }
+    len = fragment_slice(in);
+    if (frag->offset != 0)
+    {
+        if (frag->id != limits[slot].fragment_id || frag->offset != limits[slot].fragment_next || len == 0 ||
+            len > limits[slot].fragment_total - frag->offset)
+        {
+            return 0;
+        }
+        limits[slot].fragment_next += len;
+        if (limits[slot].fragment_next == limits[slot].fragment_total)
+        {
+            limits[slot].fragment_id = 0;
+        }
+        return 1;
+    }
+
+    limits[slot].fragment_id = 0;
+    if (frag->total > max_message)
+    {
+        count_event(&stats->rejected, 1);
+        out = new_notice("Message too long, rejected", SESSION_NONE);
+        fanout_send(&pool, slot, out);
+        fanout_msg_put(out);
+        return 0;
+    }
+    if (len == 0 || len >= frag->total)
+    {
+        return 0; /* A message that fits one frame is never split */
+    }
+    if (!admit(slot, bucket, limit))
+    {
+        return 0;
+    }
+    limits[slot].fragment_id = frag->id;
+    limits[slot].fragment_total = frag->total;
+    limits[slot].fragment_next = len;
+    return 1;
+}
+
+/* Build the server ---> client frame for a broadcast, private message or
+ * channel post. The sender's name, and the channel if any, are added for
+ * display; only the text that follows any name in the client frame is copied.
+ * A fragment keeps its fragment header.
+ */
+static struct fanout_msg *
+new_delivery(struct frame *in, uint8_t type, const char *sender_name, const char *channel_name)
+{
+    struct msg_fragment frag;
+    struct frame f;
+
+    frame_init(&f, type, in->u.hdr.sender);
+    if (in->u.hdr.type & MSG_FRAGMENT)
+    {
+        memcpy(&frag, frame_payload(in), sizeof(frag)); /* Leads the payload */
+        frame_put_fragment(&f, frag.id, frag.total, frag.offset);
+    }
+    frame_put_str(&f, sender_name);
+    if (channel_name != NULL)
+    {
+        frame_put_str(&f, channel_name);
+    }
+    frame_put_text(&f, frame_payload(in) + in->pos, in->u.hdr.len - in->pos);
+    return fanout_msg_new(f.u.buf, frame_size(&f));
+}
+
+/* Build a notice from the server itself */
+static struct fanout_msg *
+new_notice(const char *text, uint32_t target)
+{
+    struct frame f;
+
+    frame_init(&f, MSG_NOTICE, SESSION_NONE);
+    f.u.hdr.target = target;
+    frame_put_text(&f, text, strlen(text));
+    return fanout_msg_new(f.u.buf, frame_size(&f));
+}
+
+/* Build a header-only frame from the server */
+static struct fanout_msg *
+new_control(uint8_t type, uint32_t target)
+{
+    struct frame f;
+
+    frame_init(&f, type, SESSION_NONE);
+    f.u.hdr.target = target;
+    return fanout_msg_new(f.u.buf, frame_size(&f));
+}
+
+/* Hand a client the oldest messages stored for it while it was away.
+ * Whatever does not fit follows on the next heartbeats.
+ */
 static void
-custom_signal_handler(int signalNumber)
+replay_offline(int slot)
 {
-    siglongjmp(env, KILL);
+    struct frame stored[REPLAY_BATCH];
+    struct fanout_msg *out;
+    int n;
+
+    if (offline == NULL)
+    {
+        return;
+    }
+    n = offline_replay(offline, reg.clients[slot].user_name, stored, replay_max);
+    for (int i = 0; i < n; i++)
+    {
+        /* The worker packs them into batch frames on the way out */
+        out = fanout_msg_new(stored[i].u.buf, frame_size(&stored[i]));
+        fanout_send(&pool, slot, out);
+        fanout_msg_put(out);
+    }
 }
 
+/* Continue replaying to the clients that still have stored messages */
 static void
-alarm_handler(int sig)
+replay_pending(void)
 {
-    signal(SIGALRM, alarm_handler); /* Restablish handler for next occurrence */
-    siglongjmp(env, HEARTBEAT);
-    return;
-}
\ No newline at end of file
+    if (offline == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < reg.hdr->num_clients; i++)
+    {
+        if (offline_pending(offline, reg.clients[reg.live[i]].user_name) > 0)
+        {
+            replay_offline(reg.live[i]);
+        }
+    }
+}
+
+/* Take over the clients of a server that died. The ones still running get
+ * their MQ reopened and a fresh timeout; the others, and the socket clients
+ * whose connection is gone, are reaped.
+ */
+static void
+resume_clients(void)
+{
+    time_t now = monotonic_time();
+    int slot;
+
+    /* Walk backwards so reaping a client does not skip the one swapped into its place */
+    for (int i = reg.hdr->num_clients - 1; i >= 0; i--)
+    {
+        slot = reg.live[i];
+        if (reg.clients[slot].conn_fd != -1)
+        {
+            reg.clients[slot].conn_fd = -1; /* Not a descriptor of ours */
+            drop_client(&reg, slot);
+            continue;
+        }
+        reg.clients[slot].last_seen = now;
+        reset_limits(slot);
+        fanout_open(&pool, slot, reg.clients[slot].gen, reg.clients[slot].user_name, -1);
+        watch_client(slot);
+    }
+    printf("Resumed %d clients\n", reg.hdr->num_clients);
+}
+
+/* Drop the clients whose MQ a worker could not open or send to */
+static void
+reap_dead_clients(void)
+{
+    struct fanout_dead dead[16];
+    int n;
+
+    n = fanout_reap(&pool, dead, 16);
+    for (int i = 0; i < n; i++)
+    {
+        /* Skip if the slot was already freed or reused by a new client */
+        if (reg.clients[dead[i].slot].in_use && reg.clients[dead[i].slot].gen == dead[i].gen)
+        {
+            drop_client(&reg, dead[i].slot);
+        }
+    }
+}
+
+/* Remove a client from the registry and have its worker close the MQ */
+static void
+drop_client(struct registry *reg, int slot)
+{
+    if (reg->clients[slot].pidfd != -1)
+    {
+        close(reg->clients[slot].pidfd); /* Also removes it from epoll */
+        reg->clients[slot].pidfd = -1;
+    }
+    if (reg->clients[slot].conn_fd != -1)
+    {
+        /* The client sees the end of the connection, and we see it hang up and close it */
+        shutdown(reg->clients[slot].conn_fd, SHUT_RDWR);
+        reg->clients[slot].conn_fd = -1;
+    }
+    channel_drop_client(&channels, slot);
+    registry_remove(reg, slot);
+    fanout_close(&pool, slot);
+    count_event(&stats->leaves, 1);
+}
+
+/* Get told through epoll when the client process exits */
+static void
+watch_client(int slot)
+{
+    struct client *client = &reg.clients[slot];
+    struct epoll_event ev;
+
+    client->pidfd = syscall(SYS_pidfd_open, client->client_pid, 0);
+    if (client->pidfd == -1)
+    {
+        if (errno == ESRCH)
+        {
+            reap_exited_client(slot); /* Already gone */
+        }
+        /* Otherwise rely on the heartbeat timeout */
+        return;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_CLIENT_EXIT + slot;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client->pidfd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        close(client->pidfd);
+        client->pidfd = -1;
+    }
+}
+
+/* The pidfd of a slot became readable */
+static void
+client_exited(int slot)
+{
+    struct pollfd pfd;
+
+    /* The client may have left, and the slot been reused, since the event was queued */
+    if (slot >= reg.max_clients || !reg.clients[slot].in_use || reg.clients[slot].pidfd == -1)
+    {
+        return;
+    }
+    pfd.fd = reg.clients[slot].pidfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) == 1)
+    {
+        reap_exited_client(slot);
+    }
+}
+
+/* Drop a client whose process is gone and remove the MQ it left behind */
+static void
+reap_exited_client(int slot)
+{
+    char client_mq_name[MESSAGE_LEN];
+
+    // printf("DEBUG: Client %s exited without leaving\n", reg.clients[slot].user_name);
+    snprintf(client_mq_name, MESSAGE_LEN, "/hdp38_njs76_client_%s", reg.clients[slot].user_name);
+    drop_client(&reg, slot);
+    if (mq_unlink(client_mq_name) == -1 && errno != ENOENT)
+    {
+        perror("mq_unlink");
+    }
+}
+
+/* Accept the pending socket clients. They are named by the join frame they send first. */
+static void
+accept_connections(int listen_fd)
+{
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        add_event(epfd, fd, EV_CONNECTION + fd);
+    }
+    if (errno != EAGAIN)
+    {
+        perror("accept4");
+    }
+}
+
+/* Read what a socket client sent, up to RECV_BATCH frames with one call */
+static void
+receive_connection(int fd)
+{
+    struct frame frames[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    int n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < RECV_BATCH; i++)
+    {
+        iov[i].iov_base = frames[i].u.buf;
+        iov[i].iov_len = FRAME_MAX;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (n == -1)
+    {
+        if (errno != EAGAIN)
+        {
+            close_connection(fd);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (msgs[i].msg_len == 0) /* Client closed the connection */
+        {
+            close_connection(fd);
+            return;
+        }
+        if (frame_check(&frames[i], msgs[i].msg_len) == 0)
+        {
+            handle_client_frame(&frames[i], fd);
+        }
+    }
+    if (n == 0)
+    {
+        close_connection(fd);
+    }
+}
+
+/* Drop the client of a connection that closed and close our end */
+static void
+close_connection(int fd)
+{
+    int slot;
+
+    /* Walk backwards so dropping a client does not skip the one swapped into its place */
+    for (int i = reg.hdr->num_clients - 1; i >= 0; i--)
+    {
+        slot = reg.live[i];
+        if (reg.clients[slot].conn_fd == fd)
+        {
+            drop_client(&reg, slot);
+        }
+    }
+    /* The worker may still hold a copy, so closing alone would not remove it from epoll */
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+/* Register a descriptor for input events, tagged with its event source */
+static void
+add_event(int epfd, int fd, uint32_t source)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = source;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,292 @@
+/* Show the live metrics of a running chat server.
+ *
+ * Compile as follows: gcc -o chatstat chatstat.c metrics.c -std=c99 -Wall -lrt -lpthread
+ *
+ * Usage: chatstat [-i seconds] [-n count] [-c]
+ *
+ *   -i  Report every this many seconds, each report covering the interval
+ *       since the last one. Without -i, print one report covering everything
+ *       since the server started.
+ *   -n  Stop after this many reports
+ *   -c  Also list the lag of every connected client
+ *
+ * chatstat maps the metrics segment of every shard read-only (see metrics.c)
+ * and sums them, so watching never slows the server down.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#define _GNU_SOURCE // For getopt(), kill() and clock_gettime()
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "metrics.h"
+
+/* Everything one report needs, summed over the shards and workers */
+struct snapshot {
+    int64_t time_ns;
+    struct metrics_server server;
+    struct metrics_worker workers;
+    uint64_t pending;                   /* Fan-out jobs not yet run */
+};
+
+static const char *type_names[METRICS_TYPES] = {
+    "other", "join", "leave", "broadcast", "private", "heartbeat", "notice", "batch",
+    "join ack", "channel join", "channel leave", "channel post", "ack", "nack",
+};
+
+static struct metrics shards[SHARD_MAX];
+static int num_shards;
+
+static int64_t
+now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+hist_add(struct metrics_hist *dst, const struct metrics_hist *src)
+{
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++)
+    {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+/* What was recorded between two snapshots. The maximum cannot be split, so it stays the overall one. */
+static void
+hist_sub(struct metrics_hist *dst, const struct metrics_hist *before)
+{
+    dst->count -= before->count;
+    dst->sum -= before->sum;
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++)
+    {
+        dst->buckets[i] -= before->buckets[i];
+    }
+}
+
+/* Exit once the server is gone; the mappings would only show frozen counters */
+static void
+check_alive(void)
+{
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (kill(shards[i].seg->pid, 0) == -1 && errno == ESRCH)
+        {
+            printf("Server has exited\n");
+            exit(EXIT_SUCCESS);
+        }
+    }
+}
+
+static void
+take_snapshot(struct snapshot *snap)
+{
+    struct metrics_server server;
+    struct metrics_worker worker;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->time_ns = now_ns();
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (metrics_read(&server, &shards[i].seg->server, sizeof(server)) == -1)
+        {
+            fprintf(stderr, "Shard %d stopped in the middle of an update\n", i);
+            continue;
+        }
+        snap->server.clients += server.clients;
+        snap->server.posted += server.posted;
+        for (int t = 0; t < METRICS_TYPES; t++)
+        {
+            snap->server.received[t] += server.received[t];
+        }
+        snap->server.joins += server.joins;
+        snap->server.leaves += server.leaves;
+        snap->server.full += server.full;
+        snap->server.rejected += server.rejected;
+        hist_add(&snap->server.fanout, &server.fanout);
+
+        for (int w = 0; w < shards[i].seg->num_workers; w++)
+        {
+            if (metrics_read(&worker, &shards[i].seg->workers[w], sizeof(worker)) == -1)
+            {
+                continue;
+            }
+            snap->workers.jobs += worker.jobs;
+            snap->workers.frames += worker.frames;
+            snap->workers.messages += worker.messages;
+            snap->workers.stalls += worker.stalls;
+            snap->workers.dropped += worker.dropped;
+            snap->workers.resent += worker.resent;
+            snap->workers.lost += worker.lost;
+            hist_add(&snap->workers.send_ns, &worker.send_ns);
+        }
+    }
+    /* The workers may already have run jobs the server has not published yet */
+    snap->pending = snap->server.posted > snap->workers.jobs ? snap->server.posted - snap->workers.jobs : 0;
+}
+
+static void
+print_count(const char *name, uint64_t count, double seconds)
+{
+    printf("%-16s %12llu %12.1f\n", name, (unsigned long long)count, count / seconds);
+}
+
+static void
+print_hist(const char *name, const struct metrics_hist *h, double scale)
+{
+    printf("%-16s %12llu  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", name,
+           (unsigned long long)h->count, h->count ? h->sum / scale / h->count : 0.0,
+           metrics_hist_value(h, 0.5) / scale, metrics_hist_value(h, 0.9) / scale,
+           metrics_hist_value(h, 0.99) / scale, h->max / scale);
+}
+
+/* Print what happened between two snapshots */
+static void
+report(const struct snapshot *before, const struct snapshot *now)
+{
+    struct snapshot d = *now;
+    double seconds = (now->time_ns - before->time_ns) / 1e9;
+
+    for (int t = 0; t < METRICS_TYPES; t++)
+    {
+        d.server.received[t] -= before->server.received[t];
+    }
+    d.server.joins -= before->server.joins;
+    d.server.leaves -= before->server.leaves;
+    d.server.full -= before->server.full;
+    d.server.rejected -= before->server.rejected;
+    hist_sub(&d.server.fanout, &before->server.fanout);
+    d.workers.frames -= before->workers.frames;
+    d.workers.messages -= before->workers.messages;
+    d.workers.stalls -= before->workers.stalls;
+    d.workers.dropped -= before->workers.dropped;
+    d.workers.resent -= before->workers.resent;
+    d.workers.lost -= before->workers.lost;
+    hist_sub(&d.workers.send_ns, &before->workers.send_ns);
+
+    printf("%d shard(s), %u clients, %llu fan-out jobs pending, over %.1f s\n", num_shards,
+           now->server.clients, (unsigned long long)now->pending, seconds);
+    printf("%-16s %12s %12s\n", "", "count", "per second");
+    for (int t = 0; t < METRICS_TYPES; t++)
+    {
+        if (d.server.received[t] != 0)
+        {
+            print_count(type_names[t] != NULL ? type_names[t] : "other", d.server.received[t], seconds);
+        }
+    }
+    print_count("joins", d.server.joins, seconds);
+    print_count("leaves", d.server.leaves, seconds);
+    print_count("turned away", d.server.full, seconds);
+    print_count("rejected", d.server.rejected, seconds);
+    print_count("frames sent", d.workers.frames, seconds);
+    print_count("messages sent", d.workers.messages, seconds);
+    print_count("queue full", d.workers.stalls, seconds);
+    print_count("dropped", d.workers.dropped, seconds);
+    print_count("resent", d.workers.resent, seconds);
+    print_count("lost", d.workers.lost, seconds);
+    print_hist("fan-out", &d.server.fanout, 1);
+    print_hist("send us", &d.workers.send_ns, 1000);
+}
+
+static void
+report_clients(void)
+{
+    struct metrics_client client;
+
+    printf("%5s %-20s %8s %8s %12s %10s %10s %10s\n", "shard", "user", "queued", "max", "sent", "dropped", "stalls",
+           "resent");
+    for (int i = 0; i < num_shards; i++)
+    {
+        for (int slot = 0; slot < shards[i].seg->max_clients; slot++)
+        {
+            if (metrics_read(&client, metrics_client(shards[i].seg, slot), sizeof(client)) == -1 || !client.open)
+            {
+                continue;
+            }
+            printf("%5d %-20s %8d %8d %12llu %10llu %10llu %10llu\n", i, client.user_name, client.queued,
+                   client.max_queued, (unsigned long long)client.sent, (unsigned long long)client.dropped,
+                   (unsigned long long)client.stalls, (unsigned long long)client.resent);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static struct snapshot before, now;
+    int interval = 0;
+    int count = 0;
+    int clients = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:n:c")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'c':
+            clients = 1;
+            break;
+        default:
+            printf("Usage: %s [-i seconds] [-n count] [-c]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Shards are numbered from 0, so attach until one is missing */
+    while (num_shards < SHARD_MAX && metrics_attach(&shards[num_shards], num_shards) == 0)
+    {
+        num_shards++;
+    }
+    if (num_shards == 0)
+    {
+        printf("No chat server is running\n");
+        exit(EXIT_FAILURE);
+    }
+    check_alive();
+
+    /* The first report covers everything since the server started */
+    before.time_ns = shards[0].seg->start_ns;
+    take_snapshot(&now);
+    for (int n = 1;; n++)
+    {
+        report(&before, &now);
+        if (clients)
+        {
+            report_clients();
+        }
+        if (interval <= 0 || n == count)
+        {
+            break;
+        }
+        before = now;
+        sleep(interval);
+        check_alive();
+        take_snapshot(&now);
+        printf("\n");
+    }
+
+    for (int i = 0; i < num_shards; i++)
+    {
+        metrics_detach(&shards[i]);
+    }
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,1327 @@
+/* Fan-out workers for the chat server.
+ *
+ * The server thread receives and routes messages; delivery to the client MQs
+ * is done by a pool of worker threads. Each worker owns a shard of the client
+ * slots and the MQ descriptors of those clients, so a broadcast is delivered
+ * to every shard concurrently while the server thread keeps receiving.
+ *
+ * Client MQs are written without blocking. When a client MQ is full the
+ * message goes to a bounded outbound queue for that client and the worker
+ * waits for the MQ to become writable again, so one stuck client cannot
+ * stall the others. A full outbound queue is handled by the configured
+ * slow-consumer policy.
+ *
+ * Messages for a client are only queued while a worker runs a batch of jobs
+ * and written out once the batch is done, so everything that piled up for
+ * the same client goes out in as few batch frames as possible.
+ *
+ * The outbound queue is kept in priority order (control, then private, then
+ * broadcast) so a backlog of broadcasts never holds up a heartbeat or a
+ * private message, and each frame is sent with its mq priority.
+ *
+ * Clients on the socket transport are written the same way, except that the
+ * batch frames for a client go out together in one sendmmsg() call.
+ *
+ * Each worker keeps its counters, the time spent writing and the lag of its
+ * clients in the metrics segment of the shard (see metrics.c).
+ *
+ * Chat messages are numbered per client and lane as they are queued, before
+ * the slow-consumer policy gets a chance to drop them, and the last
+ * resend_len of each lane are kept until the client acknowledges them. The
+ * ones the policy discards are let go of at once, since sending them again
+ * would only refill the queue that overflowed. A nack queues the ones asked
+ * for again with their old numbers, unless they are still queued, or tells
+ * the client they are gone. Every client link starts with an ack from the
+ * server giving the numbers so far, so a resumed client knows they start
+ * over, and an idle client with unacknowledged messages gets one instead of
+ * a heartbeat so it notices a loss at the end of a lane.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#define _GNU_SOURCE // For eventfd and epoll
+
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "fanout.h"
+
+#define JOB_OPEN 1      /* Open the MQ of a new client */
+#define JOB_CLOSE 2     /* Close the MQ of a client that left */
+#define JOB_SEND 3      /* Deliver to one client */
+#define JOB_BROADCAST 4 /* Deliver to every client of the shard */
+#define JOB_HEARTBEAT 5 /* Deliver to every client of the shard that had no traffic */
+#define JOB_MULTICAST 6 /* Deliver to the clients of the shard in a slot bitset */
+#define JOB_LAG 7       /* Print the lag counters of the shard */
+#define JOB_ACK 8       /* Forget the messages a client acknowledged */
+#define JOB_RESEND 9    /* Send a client the messages it asked for again */
+#define JOB_STOP 10     /* Close everything and exit the worker */
+
+#define WAKE_TAG UINT32_MAX /* epoll tag of the job eventfd; other tags are slots */
+#define MAX_EVENTS 64
+#define SEND_VEC 16 /* Frames per sendmmsg() to a socket client */
+
+/* Snapshot of a subscriber bitset, shared by the workers taking part in a multicast */
+struct fanout_mask {
+    int refcnt;
+    int words;
+    uint64_t bits[];
+};
+
+struct fanout_job {
+    struct fanout_job *next;
+    int type;
+    int slot;                           /* Target slot, or slot to skip for a broadcast */
+    unsigned int gen;
+    int sock;                           /* Connection of a new socket client, -1 to open its MQ */
+    struct fanout_msg *msg;
+    struct fanout_mask *mask;           /* Recipients of a multicast */
+    char user_name[USER_NAME_LEN];
+    uint32_t acked[SEQ_LANES];          /* Last sequence number acknowledged in each lane */
+    int lane;                           /* Lane, first and count of the messages to send again */
+    uint32_t first;
+    uint32_t count;
+};
+
+static void *worker_main(void *arg);
+static void deliver(struct fanout_worker *worker, int slot, struct fanout_msg *msg);
+
+static struct fanout_worker *
+owner(struct fanout_pool *pool, int slot)
+{
+    return &pool->workers[slot % pool->num_workers];
+}
+
+static void
+post_job(struct fanout_worker *worker, struct fanout_job *job)
+{
+    uint64_t one = 1;
+    int was_empty;
+
+    job->next = NULL;
+    __atomic_add_fetch(&worker->pool->pending, 1, __ATOMIC_RELAXED);
+    worker->pool->posted++;
+    pthread_mutex_lock(&worker->lock);
+    was_empty = (worker->head == NULL);
+    if (worker->tail == NULL)
+    {
+        worker->head = job;
+    }
+    else
+    {
+        worker->tail->next = job;
+    }
+    worker->tail = job;
+    pthread_mutex_unlock(&worker->lock);
+
+    /* Only the first job of a batch needs to wake the worker */
+    if (was_empty && write(worker->wake_fd, &one, sizeof(one)) == -1)
+    {
+        perror("write");
+    }
+}
+
+static struct fanout_job *
+new_job(int type, int slot, struct fanout_msg *msg)
+{
+    struct fanout_job *job = malloc(sizeof(*job));
+
+    if (job == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    job->type = type;
+    job->slot = slot;
+    job->gen = 0;
+    job->msg = msg;
+    job->mask = NULL;
+    if (msg != NULL)
+    {
+        __atomic_add_fetch(&msg->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    return job;
+}
+
+int fanout_init(struct fanout_pool *pool, const struct fanout_config *config, int max_clients,
+                struct metrics_segment *metrics)
+{
+    struct epoll_event ev;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->config = *config;
+    pool->num_workers = config->num_workers;
+    pool->max_clients = max_clients;
+    pool->metrics = metrics;
+    pool->workers = calloc(pool->num_workers, sizeof(struct fanout_worker));
+    pool->clients = calloc(max_clients, sizeof(struct delivery));
+    pool->max_dead = 16;
+    pool->dead = malloc(pool->max_dead * sizeof(struct fanout_dead));
+    if (pool->workers == NULL || pool->clients == NULL || pool->dead == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < max_clients; i++)
+    {
+        pool->clients[i].mqd = (mqd_t)-1;
+    }
+
+    pool->reap_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->reap_fd == -1)
+    {
+        return -1;
+    }
+    pthread_mutex_init(&pool->reap_lock, NULL);
+
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        struct fanout_worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->stats = &metrics->workers[i];
+        worker->members = malloc((max_clients / pool->num_workers + 1) * sizeof(int));
+        worker->dirty = malloc((max_clients / pool->num_workers + 1) * sizeof(int));
+        worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (worker->members == NULL || worker->dirty == NULL || worker->epfd == -1 || worker->wake_fd == -1)
+        {
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.u32 = WAKE_TAG;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wake_fd, &ev) == -1)
+        {
+            return -1;
+        }
+        pthread_mutex_init(&worker->lock, NULL);
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Stop the workers. They close the MQs of their clients before exiting. */
+void fanout_destroy(struct fanout_pool *pool)
+{
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        post_job(&pool->workers[i], new_job(JOB_STOP, -1, NULL));
+    }
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        close(pool->workers[i].epfd);
+        close(pool->workers[i].wake_fd);
+        free(pool->workers[i].members);
+        free(pool->workers[i].dirty);
+    }
+    pthread_mutex_destroy(&pool->reap_lock);
+    close(pool->reap_fd);
+    free(pool->workers);
+    free(pool->clients);
+    free(pool->dead);
+}
+
+struct fanout_msg *fanout_msg_new(const void *data, size_t len)
+{
+    struct fanout_msg *msg = malloc(sizeof(*msg) + len);
+
+    if (msg == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    msg->refcnt = 1;
+    msg->prio = frame_priority(((const struct msg_hdr *)data)->type);
+    msg->len = len;
+    memcpy(msg->data, data, len);
+    return msg;
+}
+
+void fanout_msg_put(struct fanout_msg *msg)
+{
+    if (__atomic_sub_fetch(&msg->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(msg);
+    }
+}
+
+/* Start delivering to a client, through its MQ or, if sock is not -1, through
+ * that connection. The worker takes over sock and closes it with the slot.
+ */
+void fanout_open(struct fanout_pool *pool, int slot, unsigned int gen, const char *user_name, int sock)
+{
+    struct fanout_job *job = new_job(JOB_OPEN, slot, NULL);
+
+    job->gen = gen;
+    job->sock = sock;
+    snprintf(job->user_name, sizeof(job->user_name), "%s", user_name);
+    post_job(owner(pool, slot), job);
+}
+
+void fanout_close(struct fanout_pool *pool, int slot)
+{
+    post_job(owner(pool, slot), new_job(JOB_CLOSE, slot, NULL));
+}
+
+void fanout_send(struct fanout_pool *pool, int slot, struct fanout_msg *msg)
+{
+    post_job(owner(pool, slot), new_job(JOB_SEND, slot, msg));
+}
+
+/* Deliver msg to every open client except exclude_slot (-1 for none) */
+void fanout_broadcast(struct fanout_pool *pool, struct fanout_msg *msg, int exclude_slot)
+{
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        post_job(&pool->workers[i], new_job(JOB_BROADCAST, exclude_slot, msg));
+    }
+}
+
+/* Deliver msg to the open clients that got no other traffic since the last heartbeat */
+void fanout_heartbeat(struct fanout_pool *pool, struct fanout_msg *msg)
+{
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        post_job(&pool->workers[i], new_job(JOB_HEARTBEAT, -1, msg));
+    }
+}
+
+/* Deliver msg to the open clients whose bit is set in members, except exclude_slot */
+void fanout_multicast(struct fanout_pool *pool, struct fanout_msg *msg, const uint64_t *members, int words,
+                      int exclude_slot)
+{
+    struct fanout_mask *mask = malloc(sizeof(*mask) + words * sizeof(uint64_t));
+    struct fanout_job *job;
+
+    if (mask == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    /* The server thread keeps changing the subscriptions, so the workers get a copy */
+    mask->refcnt = pool->num_workers;
+    mask->words = words;
+    memcpy(mask->bits, members, words * sizeof(uint64_t));
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        job = new_job(JOB_MULTICAST, exclude_slot, msg);
+        job->mask = mask;
+        post_job(&pool->workers[i], job);
+    }
+}
+
+/* Let go of the messages a client acknowledged, up to acked[lane] in each lane */
+void fanout_ack(struct fanout_pool *pool, int slot, const uint32_t *acked)
+{
+    struct fanout_job *job = new_job(JOB_ACK, slot, NULL);
+
+    memcpy(job->acked, acked, sizeof(job->acked));
+    post_job(owner(pool, slot), job);
+}
+
+/* Send a client count messages of a lane again, from sequence number first on */
+void fanout_resend(struct fanout_pool *pool, int slot, int lane, uint32_t first, uint32_t count)
+{
+    struct fanout_job *job = new_job(JOB_RESEND, slot, NULL);
+
+    job->lane = lane;
+    job->first = first;
+    job->count = count;
+    post_job(owner(pool, slot), job);
+}
+
+/* Have every worker print the lag counters of its clients */
+void fanout_report_lag(struct fanout_pool *pool)
+{
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        post_job(&pool->workers[i], new_job(JOB_LAG, -1, NULL));
+    }
+}
+
+/* Number of jobs waiting for a worker, a measure of the fan-out backlog */
+int fanout_pending(struct fanout_pool *pool)
+{
+    return __atomic_load_n(&pool->pending, __ATOMIC_RELAXED);
+}
+
+/* Collect clients the workers could not deliver to. Returns the number copied. */
+int fanout_reap(struct fanout_pool *pool, struct fanout_dead *dead, int max)
+{
+    uint64_t count;
+    int n;
+
+    if (read(pool->reap_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        perror("read");
+    }
+
+    pthread_mutex_lock(&pool->reap_lock);
+    n = pool->num_dead < max ? pool->num_dead : max;
+    memcpy(dead, pool->dead, n * sizeof(struct fanout_dead));
+    pool->num_dead -= n;
+    memmove(pool->dead, pool->dead + n, pool->num_dead * sizeof(struct fanout_dead));
+    if (pool->num_dead > 0)
+    {
+        count = 1; /* Still more to collect, stay readable */
+        if (write(pool->reap_fd, &count, sizeof(count)) == -1)
+        {
+            perror("write");
+        }
+    }
+    pthread_mutex_unlock(&pool->reap_lock);
+    return n;
+}
+
+/* Tell the server thread that a client can no longer be reached */
+static void
+report_dead(struct fanout_pool *pool, int slot, unsigned int gen)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&pool->reap_lock);
+    if (pool->num_dead == pool->max_dead)
+    {
+        pool->max_dead *= 2;
+        pool->dead = realloc(pool->dead, pool->max_dead * sizeof(struct fanout_dead));
+        if (pool->dead == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pool->dead[pool->num_dead].slot = slot;
+    pool->dead[pool->num_dead].gen = gen;
+    pool->num_dead++;
+    pthread_mutex_unlock(&pool->reap_lock);
+
+    if (write(pool->reap_fd, &one, sizeof(one)) == -1)
+    {
+        perror("write");
+    }
+}
+
+/* Outbound queue helpers. The queue is a ring of queue_len entries. */
+static struct queued *
+queue_at(struct fanout_pool *pool, struct delivery *d, int i)
+{
+    return &d->queue[(d->q_head + i) % pool->config.queue_len];
+}
+
+/* Insert behind every queued message of the same or higher priority */
+static void
+queue_push(struct fanout_pool *pool, struct delivery *d, struct fanout_msg *msg, uint32_t seq)
+{
+    int i;
+
+    __atomic_add_fetch(&msg->refcnt, 1, __ATOMIC_RELAXED);
+    for (i = d->q_len; i > 0 && queue_at(pool, d, i - 1)->msg->prio < msg->prio; i--)
+    {
+        *queue_at(pool, d, i) = *queue_at(pool, d, i - 1);
+    }
+    queue_at(pool, d, i)->msg = msg;
+    queue_at(pool, d, i)->seq = seq;
+    d->q_len++;
+    if (d->q_len > d->lag.max_queued)
+    {
+        d->lag.max_queued = d->q_len;
+    }
+}
+
+static void
+queue_pop(struct fanout_pool *pool, struct delivery *d)
+{
+    fanout_msg_put(d->queue[d->q_head].msg);
+    d->q_head = (d->q_head + 1) % pool->config.queue_len;
+    d->q_len--;
+}
+
+/* Remove the i-th queued message */
+static void
+queue_remove(struct fanout_pool *pool, struct delivery *d, int i)
+{
+    fanout_msg_put(queue_at(pool, d, i)->msg);
+    for (; i < d->q_len - 1; i++)
+    {
+        *queue_at(pool, d, i) = *queue_at(pool, d, i + 1);
+    }
+    d->q_len--;
+}
+
+/* 1 if message seq of a lane is still waiting in the outbound queue */
+static int
+queue_has(struct fanout_pool *pool, struct delivery *d, int lane, uint32_t seq)
+{
+    for (int i = 0; i < d->q_len; i++)
+    {
+        if (queue_at(pool, d, i)->seq == seq && queue_at(pool, d, i)->msg->prio == lane)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Forget the oldest message kept for sending again */
+static void
+resend_forget(struct fanout_pool *pool, struct resend_ring *r)
+{
+    if (r->msgs[r->head] != NULL)
+    {
+        fanout_msg_put(r->msgs[r->head]);
+    }
+    r->head = (r->head + 1) % pool->config.resend_len;
+    r->len--;
+    r->first++;
+}
+
+/* Keep a numbered message for sending again, forgetting the oldest if the ring is full */
+static void
+resend_keep(struct fanout_pool *pool, struct resend_ring *r, struct fanout_msg *msg, uint32_t seq)
+{
+    if (r->len == pool->config.resend_len)
+    {
+        resend_forget(pool, r);
+    }
+    if (r->len == 0)
+    {
+        r->first = seq;
+    }
+    __atomic_add_fetch(&msg->refcnt, 1, __ATOMIC_RELAXED);
+    r->msgs[(r->head + r->len) % pool->config.resend_len] = msg;
+    r->len++;
+}
+
+/* Let go of a numbered message the slow-consumer policy discarded, so a
+ * nack for it is answered as lost rather than sending it again
+ */
+static void
+resend_drop(struct fanout_pool *pool, struct delivery *d, struct fanout_msg *msg, uint32_t seq)
+{
+    struct resend_ring *r;
+    struct fanout_msg **kept;
+
+    if (seq == 0 || msg->prio >= SEQ_LANES)
+    {
+        return;
+    }
+    r = &d->resend[msg->prio];
+    if (r->len == 0 || seq < r->first || seq - r->first >= (uint32_t)r->len)
+    {
+        return;
+    }
+    kept = &r->msgs[(r->head + (seq - r->first)) % pool->config.resend_len];
+    if (*kept != NULL)
+    {
+        fanout_msg_put(*kept);
+        *kept = NULL;
+    }
+}
+
+static int64_t
+now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Copy the lag counters of a client to the metrics segment */
+static void
+publish_lag(struct fanout_worker *worker, int slot)
+{
+    struct delivery *d = &worker->pool->clients[slot];
+    struct metrics_client *mc = metrics_client(worker->pool->metrics, slot);
+
+    metrics_begin(&mc->seq);
+    mc->open = d->mqd != (mqd_t)-1;
+    memcpy(mc->user_name, d->user_name, sizeof(mc->user_name));
+    mc->queued = d->q_len;
+    mc->max_queued = d->lag.max_queued;
+    mc->sent = d->lag.sent;
+    mc->dropped = d->lag.dropped;
+    mc->stalls = d->lag.stalls;
+    mc->resent = d->lag.resent;
+    metrics_end(&mc->seq);
+}
+
+static void
+count_dropped(struct fanout_worker *worker, struct delivery *d, int n)
+{
+    d->lag.dropped += n;
+    metrics_begin(&worker->stats->seq);
+    worker->stats->dropped += n;
+    metrics_end(&worker->stats->seq);
+}
+
+static void
+close_member(struct fanout_worker *worker, int slot)
+{
+    struct fanout_pool *pool = worker->pool;
+    struct delivery *d = &pool->clients[slot];
+    int moved;
+
+    if (d->mqd == (mqd_t)-1)
+    {
+        return;
+    }
+    if (d->waiting && d->is_socket)
+    {
+        /* The server still holds the connection, so closing our copy would leave it in the epoll set */
+        epoll_ctl(worker->epfd, EPOLL_CTL_DEL, (int)d->mqd, NULL);
+    }
+    if ((d->is_socket ? close(d->mqd) : mq_close(d->mqd)) == -1) /* Also removes it from the worker epoll set */
+    {
+        perror(d->is_socket ? "close" : "mq_close");
+    }
+    d->mqd = (mqd_t)-1;
+    d->waiting = 0;
+    while (d->q_len > 0)
+    {
+        queue_pop(pool, d);
+    }
+    free(d->queue);
+    d->queue = NULL;
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        while (d->resend[lane].len > 0)
+        {
+            resend_forget(pool, &d->resend[lane]);
+        }
+        free(d->resend[lane].msgs);
+        d->resend[lane].msgs = NULL;
+    }
+    publish_lag(worker, slot);
+
+    /* Swap the last member into the hole */
+    moved = worker->members[--worker->num_members];
+    worker->members[d->member_idx] = moved;
+    pool->clients[moved].member_idx = d->member_idx;
+}
+
+/* Close a client and let the server thread drop it from the registry */
+static void
+evict_member(struct fanout_worker *worker, int slot)
+{
+    report_dead(worker->pool, slot, worker->pool->clients[slot].gen);
+    close_member(worker, slot);
+}
+
+/* Tell a client the last sequence number given out in each lane */
+static void
+send_sync(struct fanout_worker *worker, int slot)
+{
+    struct delivery *d = &worker->pool->clients[slot];
+    struct fanout_msg *msg;
+    struct frame f;
+
+    frame_init(&f, MSG_ACK, SESSION_NONE);
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        frame_put_u32(&f, d->seq[lane]);
+    }
+    msg = fanout_msg_new(f.u.buf, frame_size(&f));
+    deliver(worker, slot, msg);
+    fanout_msg_put(msg);
+}
+
+static void
+open_member(struct fanout_worker *worker, int slot, unsigned int gen, const char *user_name, int sock)
+{
+    struct fanout_pool *pool = worker->pool;
+    struct delivery *d = &pool->clients[slot];
+    char client_mq_name[MESSAGE_LEN];
+
+    close_member(worker, slot);
+
+    if (sock != -1)
+    {
+        d->mqd = sock; /* Already non-blocking */
+        d->is_socket = 1;
+    }
+    else
+    {
+        snprintf(client_mq_name, MESSAGE_LEN, "/hdp38_njs76_client_%s", user_name);
+        client_mq_name[strcspn(client_mq_name, "\n")] = 0; // remove newline from client name
+        d->mqd = mq_open(client_mq_name, O_WRONLY | O_NONBLOCK);
+        d->is_socket = 0;
+    }
+    d->gen = gen;
+    if (d->mqd == (mqd_t)-1)
+    {
+        perror("Could not open client MQ");
+        report_dead(pool, slot, gen);
+        return;
+    }
+    d->queue = malloc(pool->config.queue_len * sizeof(struct queued));
+    if (d->queue == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        d->seq[lane] = 0;
+        d->resend[lane].msgs = malloc(pool->config.resend_len * sizeof(struct fanout_msg *));
+        d->resend[lane].head = d->resend[lane].len = 0;
+        if (d->resend[lane].msgs == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    snprintf(d->user_name, sizeof(d->user_name), "%s", user_name);
+    d->q_head = d->q_len = 0;
+    d->waiting = 0;
+    d->active = 0;
+    d->resync = 0;
+    memset(&d->lag, 0, sizeof(d->lag));
+    d->member_idx = worker->num_members;
+    worker->members[worker->num_members++] = slot;
+    publish_lag(worker, slot);
+
+    /* Numbering starts over, which a client resumed after a crash has to be told */
+    send_sync(worker, slot);
+}
+
+/* Write the sequence number into the header of a frame about to be sent */
+static void
+stamp_seq(char *data, uint32_t seq)
+{
+    memcpy(data + offsetof(struct msg_hdr, seq), &seq, sizeof(seq));
+}
+
+/* Pack queued messages from position start on into one frame: a batch frame
+ * holding as many messages of the same priority as fit, or the next message
+ * alone. Points iov at the frame and returns the number of messages in it.
+ */
+static int
+pack_frame(struct fanout_pool *pool, struct delivery *d, int start, struct frame *batch, struct iovec *iov)
+{
+    struct queued *q = queue_at(pool, d, start);
+    unsigned int prio = q->msg->prio;
+    int n;
+
+    if (d->q_len - start > 1)
+    {
+        frame_init(batch, MSG_FRAME_BATCH, 0);
+        for (n = 0; start + n < d->q_len; n++)
+        {
+            q = queue_at(pool, d, start + n);
+            if (q->msg->prio != prio || frame_batch_add(batch, q->msg->data, q->msg->len) == -1)
+            {
+                break;
+            }
+            stamp_seq(frame_payload(batch) + batch->u.hdr.len - q->msg->len, q->seq);
+        }
+        if (n > 1)
+        {
+            iov->iov_base = batch->u.buf;
+            iov->iov_len = frame_size(batch);
+            return n;
+        }
+        /* Next message alone is too big to share a frame */
+        q = queue_at(pool, d, start);
+    }
+
+    iov->iov_base = q->msg->data;
+    iov->iov_len = q->msg->len;
+    if (q->seq != 0)
+    {
+        /* Other recipients share the message, so number a copy */
+        memcpy(batch->u.buf, q->msg->data, q->msg->len);
+        stamp_seq(batch->u.buf, q->seq);
+        iov->iov_base = batch->u.buf;
+    }
+    return 1;
+}
+
+/* Write queued messages to the client until its MQ or socket is full or the
+ * queue is empty. A client MQ takes one frame per call; a socket takes up to
+ * SEND_VEC frames per sendmmsg(). Returns -1 if the client was evicted.
+ */
+static int
+flush_member(struct fanout_worker *worker, int slot)
+{
+    struct fanout_pool *pool = worker->pool;
+    struct delivery *d = &pool->clients[slot];
+    struct frame batches[SEND_VEC];
+    struct mmsghdr msgs[SEND_VEC];
+    struct iovec iov[SEND_VEC];
+    int counts[SEND_VEC];
+    struct epoll_event ev;
+    int num_frames;
+    int packed;
+    int sent;
+    int64_t start;
+
+    while (d->q_len > 0)
+    {
+        num_frames = 0;
+        packed = 0;
+        while (packed < d->q_len && num_frames < (d->is_socket ? SEND_VEC : 1))
+        {
+            counts[num_frames] = pack_frame(pool, d, packed, &batches[num_frames], &iov[num_frames]);
+            packed += counts[num_frames];
+            num_frames++;
+        }
+
+        start = now_ns();
+        if (d->is_socket)
+        {
+            memset(msgs, 0, num_frames * sizeof(struct mmsghdr));
+            for (int i = 0; i < num_frames; i++)
+            {
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            /* May send only some of them if the socket fills up */
+            sent = sendmmsg(d->mqd, msgs, num_frames, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        else
+        {
+            sent = mq_send(d->mqd, iov[0].iov_base, iov[0].iov_len, queue_at(pool, d, 0)->msg->prio) == -1 ? -1 : 1;
+        }
+        metrics_begin(&worker->stats->seq);
+        metrics_hist_add(&worker->stats->send_ns, now_ns() - start);
+        metrics_end(&worker->stats->seq);
+
+        if (sent == -1)
+        {
+            if (errno != EAGAIN)
+            {
+                perror(d->is_socket ? "sendmmsg" : "mq_send");
+                /* Recipient queue is gone, stop using it and let the server drop the client */
+                evict_member(worker, slot);
+                return -1;
+            }
+
+            /* Client MQ or socket is full, wait until it drains */
+            d->lag.stalls++;
+            metrics_begin(&worker->stats->seq);
+            worker->stats->stalls++;
+            metrics_end(&worker->stats->seq);
+            if (!d->waiting)
+            {
+                ev.events = EPOLLOUT;
+                ev.data.u32 = slot;
+                if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, (int)d->mqd, &ev) == -1)
+                {
+                    perror("epoll_ctl");
+                }
+                d->waiting = 1;
+            }
+            publish_lag(worker, slot);
+            return 0;
+        }
+        metrics_begin(&worker->stats->seq);
+        worker->stats->frames += sent;
+        for (int i = 0; i < sent; i++)
+        {
+            d->lag.sent += counts[i];
+            worker->stats->messages += counts[i];
+            while (counts[i]-- > 0)
+            {
+                queue_pop(pool, d);
+            }
+        }
+        metrics_end(&worker->stats->seq);
+    }
+
+    if (d->waiting)
+    {
+        epoll_ctl(worker->epfd, EPOLL_CTL_DEL, (int)d->mqd, NULL);
+        d->waiting = 0;
+    }
+    if (d->resync)
+    {
+        /* Caught up after a drop: tell the client how far each lane got, in case the drop was the last of one */
+        d->resync = 0;
+        send_sync(worker, slot);
+        return flush_member(worker, slot);
+    }
+    publish_lag(worker, slot);
+    return 0;
+}
+
+/* Make room in a full outbound queue. Returns 0 if msg should still be queued. */
+static int
+apply_policy(struct fanout_worker *worker, int slot, struct fanout_msg *msg)
+{
+    struct fanout_pool *pool = worker->pool;
+    struct delivery *d = &pool->clients[slot];
+    struct fanout_msg *notice;
+    struct frame f;
+    char text[MESSAGE_LEN];
+    int missed;
+    int oldest;
+    unsigned int lowest;
+
+    d->resync = 1;
+    switch (pool->config.policy)
+    {
+    case POLICY_COALESCE:
+        /* Replace the chat backlog with a single notice. Control frames have
+         * no number the client could ask for them again by, so they stay.
+         */
+        missed = 0;
+        for (int i = d->q_len - 1; i >= 0; i--)
+        {
+            if (queue_at(pool, d, i)->seq != 0)
+            {
+                resend_drop(pool, d, queue_at(pool, d, i)->msg, queue_at(pool, d, i)->seq);
+                queue_remove(pool, d, i);
+                missed++;
+            }
+        }
+        if (missed == 0)
+        {
+            count_dropped(worker, d, 1);
+            return -1;
+        }
+        count_dropped(worker, d, missed);
+        if (d->q_len + 2 <= pool->config.queue_len) /* Room for msg as well */
+        {
+            snprintf(text, sizeof(text), "You missed %d messages", missed);
+            frame_init(&f, MSG_NOTICE, 0);
+            frame_put_text(&f, text, strlen(text));
+            notice = fanout_msg_new(f.u.buf, frame_size(&f));
+            queue_push(pool, d, notice, 0);
+            fanout_msg_put(notice);
+        }
+        return 0;
+
+    case POLICY_DISCONNECT:
+        count_dropped(worker, d, 1);
+        if (d->lag.dropped >= (unsigned long)pool->config.threshold)
+        {
+            fprintf(stderr, "Disconnecting slow client %s\n", d->user_name);
+            evict_member(worker, slot);
+        }
+        return -1;
+
+    case POLICY_DROP_OLDEST:
+    default:
+        /* Drop the oldest message of the lowest priority, which may be msg
+         * itself. Control frames are queued first and never dropped for
+         * another message, so a queue of nothing else turns msg away.
+         */
+        count_dropped(worker, d, 1);
+        lowest = queue_at(pool, d, d->q_len - 1)->msg->prio;
+        if (msg->prio < lowest || lowest >= SEQ_LANES)
+        {
+            return -1;
+        }
+        oldest = d->q_len - 1;
+        while (oldest > 0 && queue_at(pool, d, oldest - 1)->msg->prio == lowest)
+        {
+            oldest--;
+        }
+        resend_drop(pool, d, queue_at(pool, d, oldest)->msg, queue_at(pool, d, oldest)->seq);
+        queue_remove(pool, d, oldest);
+        return 0;
+    }
+}
+
+/* Queue msg for a client with the given sequence number. It is written out
+ * by flush_dirty() at the end of the job batch.
+ */
+static void
+enqueue(struct fanout_worker *worker, int slot, struct fanout_msg *msg, uint32_t seq)
+{
+    struct fanout_pool *pool = worker->pool;
+    struct delivery *d = &pool->clients[slot];
+
+    if (d->q_len == pool->config.queue_len)
+    {
+        /* Make room by writing out what the client MQ will take before giving up on anything */
+        if (!d->waiting && flush_member(worker, slot) == -1)
+        {
+            return;
+        }
+        if (d->q_len == pool->config.queue_len && apply_policy(worker, slot, msg) == -1)
+        {
+            resend_drop(pool, d, msg, seq);
+            return;
+        }
+    }
+    /* Queue behind any backlog of the same priority so the client still sees them in order */
+    queue_push(pool, d, msg, seq);
+    if (!d->dirty)
+    {
+        d->dirty = 1;
+        worker->dirty[worker->num_dirty++] = slot;
+    }
+}
+
+/* Queue msg for a client, numbered in its lane and kept for sending again if it is a chat message */
+static void
+deliver(struct fanout_worker *worker, int slot, struct fanout_msg *msg)
+{
+    struct delivery *d = &worker->pool->clients[slot];
+    uint32_t seq = 0;
+
+    if (msg->prio < SEQ_LANES)
+    {
+        seq = ++d->seq[msg->prio];
+        resend_keep(worker->pool, &d->resend[msg->prio], msg, seq);
+    }
+    enqueue(worker, slot, msg, seq);
+}
+
+/* Let go of the messages a client has received */
+static void
+ack_member(struct fanout_worker *worker, int slot, const uint32_t *acked)
+{
+    struct resend_ring *r;
+
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        r = &worker->pool->clients[slot].resend[lane];
+        while (r->len > 0 && r->first <= acked[lane])
+        {
+            resend_forget(worker->pool, r);
+        }
+    }
+}
+
+/* Tell a client count messages of a lane from first on are gone for good */
+static void
+send_lost(struct fanout_worker *worker, int slot, int lane, uint32_t first, uint32_t count)
+{
+    struct fanout_msg *msg;
+    struct frame f;
+
+    frame_init(&f, MSG_NACK, SESSION_NONE);
+    frame_put_u32(&f, lane);
+    frame_put_u32(&f, first);
+    frame_put_u32(&f, count);
+    msg = fanout_msg_new(f.u.buf, frame_size(&f));
+    enqueue(worker, slot, msg, 0);
+    fanout_msg_put(msg);
+    metrics_begin(&worker->stats->seq);
+    worker->stats->lost += count;
+    metrics_end(&worker->stats->seq);
+}
+
+/* Queue the messages of a lane a client asked for again under their old
+ * numbers, unless they are still queued, and tell it which of them are no
+ * longer kept or were discarded by the slow-consumer policy
+ */
+static void
+resend_member(struct fanout_worker *worker, int slot, int lane, uint32_t first, uint32_t count)
+{
+    struct fanout_pool *pool = worker->pool;
+    struct delivery *d = &pool->clients[slot];
+    struct resend_ring *r;
+    struct fanout_msg *msg;
+    uint32_t last;
+    uint32_t kept;
+    uint32_t lost;
+    uint32_t lost_from = 0;
+
+    if (lane < 0 || lane >= SEQ_LANES || first == 0 || count == 0 || first > d->seq[lane])
+    {
+        return;
+    }
+    r = &d->resend[lane];
+    last = count - 1 > d->seq[lane] - first ? d->seq[lane] : first + count - 1;
+    kept = r->len > 0 ? r->first : d->seq[lane] + 1; /* Oldest still kept */
+
+    if (first < kept)
+    {
+        lost = (last < kept ? last + 1 : kept) - first;
+        send_lost(worker, slot, lane, first, lost);
+        first += lost;
+    }
+    lost = 0;
+    for (uint32_t seq = first; seq <= last && seq >= first; seq++)
+    {
+        /* The slow-consumer policy may disconnect the client meanwhile */
+        if (d->mqd == (mqd_t)-1)
+        {
+            return;
+        }
+        msg = r->msgs[(r->head + (seq - r->first)) % pool->config.resend_len];
+        if (msg == NULL)
+        {
+            /* Discarded on purpose, so it stays missed */
+            lost_from = lost == 0 ? seq : lost_from;
+            lost++;
+            continue;
+        }
+        if (lost > 0)
+        {
+            send_lost(worker, slot, lane, lost_from, lost);
+            lost = 0;
+            if (d->mqd == (mqd_t)-1)
+            {
+                return;
+            }
+        }
+        if (queue_has(pool, d, lane, seq))
+        {
+            continue; /* Not sent yet, so not lost either */
+        }
+        enqueue(worker, slot, msg, seq);
+        d->lag.resent++;
+        metrics_begin(&worker->stats->seq);
+        worker->stats->resent++;
+        metrics_end(&worker->stats->seq);
+    }
+    if (lost > 0 && d->mqd != (mqd_t)-1)
+    {
+        send_lost(worker, slot, lane, lost_from, lost);
+    }
+}
+
+/* Write out everything queued during the job batch */
+static void
+flush_dirty(struct fanout_worker *worker)
+{
+    struct delivery *d;
+    int slot;
+
+    for (int i = 0; i < worker->num_dirty; i++)
+    {
+        slot = worker->dirty[i];
+        d = &worker->pool->clients[slot];
+        d->dirty = 0;
+        /* Skip clients closed since, and clients already waiting for EPOLLOUT */
+        if (d->mqd != (mqd_t)-1 && !d->waiting)
+        {
+            flush_member(worker, slot);
+        }
+    }
+    worker->num_dirty = 0;
+}
+
+/* 1 if a client has not acknowledged every message it was sent */
+static int
+unacknowledged(struct delivery *d)
+{
+    for (int lane = 0; lane < SEQ_LANES; lane++)
+    {
+        if (d->resend[lane].len > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+report_lag(struct fanout_worker *worker)
+{
+    struct delivery *d;
+
+    for (int i = 0; i < worker->num_members; i++)
+    {
+        d = &worker->pool->clients[worker->members[i]];
+        printf("lag %s: queued %d max %d sent %lu dropped %lu stalls %lu resent %lu\n", d->user_name,
+               d->q_len, d->lag.max_queued, d->lag.sent, d->lag.dropped, d->lag.stalls, d->lag.resent);
+    }
+    fflush(stdout);
+}
+
+/* Run every job posted so far. Returns -1 when the worker must exit. */
+static int
+run_jobs(struct fanout_worker *worker)
+{
+    struct fanout_pool *pool = worker->pool;
+    struct fanout_job *job, *next;
+    uint64_t count;
+    uint64_t bits;
+    uint64_t jobs = 0;
+    int slot;
+    int ret = 0;
+
+    if (read(worker->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        perror("read");
+    }
+
+    /* Take every pending job at once */
+    pthread_mutex_lock(&worker->lock);
+    job = worker->head;
+    worker->head = worker->tail = NULL;
+    pthread_mutex_unlock(&worker->lock);
+
+    for (; job != NULL; job = next)
+    {
+        next = job->next;
+        switch (job->type)
+        {
+        case JOB_OPEN:
+            open_member(worker, job->slot, job->gen, job->user_name, job->sock);
+            break;
+
+        case JOB_CLOSE:
+            close_member(worker, job->slot);
+            break;
+
+        case JOB_SEND:
+            if (pool->clients[job->slot].mqd != (mqd_t)-1)
+            {
+                deliver(worker, job->slot, job->msg);
+                pool->clients[job->slot].active = 1;
+            }
+            break;
+
+        case JOB_BROADCAST:
+            /* Walk backwards so closing a member does not skip the one swapped into its place */
+            for (int i = worker->num_members - 1; i >= 0; i--)
+            {
+                slot = worker->members[i];
+                if (slot != job->slot)
+                {
+                    deliver(worker, slot, job->msg);
+                    pool->clients[slot].active = 1;
+                }
+            }
+            break;
+
+        case JOB_HEARTBEAT:
+            /* Any other traffic already told the client the server is alive. A
+             * client with messages not yet acknowledged gets the sequence
+             * numbers instead, in case it missed the last ones.
+             */
+            for (int i = worker->num_members - 1; i >= 0; i--)
+            {
+                slot = worker->members[i];
+                if (!pool->clients[slot].active)
+                {
+                    if (unacknowledged(&pool->clients[slot]))
+                    {
+                        send_sync(worker, slot);
+                    }
+                    else
+                    {
+                        deliver(worker, slot, job->msg);
+                    }
+                }
+                pool->clients[slot].active = 0;
+            }
+            break;
+
+        case JOB_MULTICAST:
+            /* Visit only the set bits, lowest slot first */
+            for (int w = 0; w < job->mask->words; w++)
+            {
+                bits = job->mask->bits[w];
+                while (bits != 0)
+                {
+                    slot = w * 64 + __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    if (owner(pool, slot) == worker && slot != job->slot && pool->clients[slot].mqd != (mqd_t)-1)
+                    {
+                        deliver(worker, slot, job->msg);
+                        pool->clients[slot].active = 1;
+                    }
+                }
+            }
+            break;
+
+        case JOB_LAG:
+            report_lag(worker);
+            break;
+
+        case JOB_ACK:
+            if (pool->clients[job->slot].mqd != (mqd_t)-1)
+            {
+                ack_member(worker, job->slot, job->acked);
+            }
+            break;
+
+        case JOB_RESEND:
+            if (pool->clients[job->slot].mqd != (mqd_t)-1)
+            {
+                resend_member(worker, job->slot, job->lane, job->first, job->count);
+            }
+            break;
+
+        case JOB_STOP:
+            while (worker->num_members > 0)
+            {
+                close_member(worker, worker->members[0]);
+            }
+            ret = -1;
+            break;
+
+        default:
+            break;
+        }
+
+        if (job->msg != NULL)
+        {
+            fanout_msg_put(job->msg);
+        }
+        if (job->mask != NULL && __atomic_sub_fetch(&job->mask->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            free(job->mask);
+        }
+        free(job);
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+        jobs++;
+    }
+    metrics_begin(&worker->stats->seq);
+    worker->stats->jobs += jobs;
+    metrics_end(&worker->stats->seq);
+
+    if (ret == 0)
+    {
+        flush_dirty(worker);
+    }
+    return ret;
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct fanout_worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int nfds;
+
+    while (1)
+    {
+        nfds = epoll_wait(worker->epfd, events, MAX_EVENTS, -1);
+        if (nfds == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < nfds; i++)
+        {
+            if (events[i].data.u32 == WAKE_TAG)
+            {
+                if (run_jobs(worker) == -1)
+                {
+                    return NULL;
+                }
+            }
+            else if (worker->pool->clients[events[i].data.u32].waiting)
+            {
+                /* A client MQ with a backlog became writable */
+                flush_member(worker, events[i].data.u32);
+            }
+        }
+    }
+    return NULL;
+}
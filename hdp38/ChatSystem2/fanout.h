@@ -0,0 +1,144 @@
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+#include <mqueue.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "msg_structure.h"
+#include "metrics.h"
+
+/* What a worker does when the outbound queue of a slow client is full */
+#define POLICY_DROP_OLDEST 0            /* Drop the oldest queued chat message */
+#define POLICY_COALESCE 1               /* Replace the chat backlog with one "missed N messages" notice */
+#define POLICY_DISCONNECT 2             /* Drop new messages, disconnect after threshold drops */
+
+/* Message handed to the fan-out workers. One copy is shared by every
+ * worker taking part in a broadcast and freed by the last one done with it.
+ * fanout_msg_new() returns the caller's reference, dropped with fanout_msg_put().
+ */
+struct fanout_msg {
+    int refcnt;                         /* Jobs and outbound queues still referencing the message */
+    unsigned int prio;                  /* PRIO_* of the frame */
+    size_t len;                         /* Bytes in data */
+    char data[];                        /* Frame as sent on the client MQ */
+};
+
+/* A message in an outbound queue, with the number it goes out with */
+struct queued {
+    struct fanout_msg *msg;
+    uint32_t seq;                       /* Sequence number in the lane of msg->prio, 0 if unnumbered */
+};
+
+/* Numbered messages of one lane kept for sending again, oldest first. The
+ * ring holds seq first up to first + len - 1 and forgets the oldest when it
+ * is full or acknowledged.
+ */
+struct resend_ring {
+    struct fanout_msg **msgs;           /* resend_len entries */
+    int head;
+    int len;
+    uint32_t first;                     /* Sequence number of the oldest message kept */
+};
+
+/* Per-client lag counters */
+struct fanout_lag {
+    unsigned long sent;                 /* Messages written to the client MQ or socket */
+    unsigned long dropped;              /* Messages discarded by the slow-consumer policy */
+    unsigned long stalls;               /* Times the client MQ was found full */
+    unsigned long resent;               /* Messages sent again on a nack */
+    int max_queued;                     /* High-water mark of the outbound queue */
+};
+
+/* Delivery state of one client slot. Only touched by the owning worker. */
+struct delivery {
+    mqd_t mqd;                          /* Client MQ or connected socket (non-blocking), -1 if the slot is closed */
+    int is_socket;                      /* 1 if mqd is a socket of the socket transport */
+    unsigned int gen;                   /* Registry generation the MQ was opened for */
+    int member_idx;                     /* Position in the owning worker's member list */
+    char user_name[USER_NAME_LEN];
+    struct queued *queue;               /* Outbound queue, highest priority first, FIFO within a priority */
+    int q_head;
+    int q_len;
+    int waiting;                        /* 1 while registered for EPOLLOUT on the client MQ */
+    int dirty;                          /* 1 while on the owning worker's flush list */
+    int active;                         /* 1 if the client got chat traffic since the last heartbeat */
+    uint32_t seq[SEQ_LANES];            /* Last sequence number given out in each lane */
+    int resync;                         /* 1 if messages were dropped since the client was told seq */
+    struct resend_ring resend[SEQ_LANES];
+    struct fanout_lag lag;
+};
+
+/* Client found dead by a worker, reported back to the server thread */
+struct fanout_dead {
+    int slot;
+    unsigned int gen;
+};
+
+/* Backpressure settings */
+struct fanout_config {
+    int num_workers;
+    int queue_len;                      /* Outbound queue capacity per client */
+    int policy;                         /* One of POLICY_* */
+    int threshold;                      /* Drops before POLICY_DISCONNECT evicts a client */
+    int resend_len;                     /* Numbered messages kept per client and lane for sending again */
+};
+
+struct fanout_job;
+struct fanout_pool;
+
+/* A worker owns the client slots with slot % num_workers == its index and
+ * runs its jobs in FIFO order, so every recipient sees messages in the
+ * order the server thread received them. It sleeps in epoll on an eventfd
+ * signalled when jobs are posted and on the MQs of clients with a backlog.
+ */
+struct fanout_worker {
+    pthread_t thread;
+    struct fanout_pool *pool;
+    int epfd;
+    int wake_fd;                        /* eventfd, written when the job list becomes non-empty */
+    pthread_mutex_t lock;
+    struct fanout_job *head;            /* Pending jobs, oldest first */
+    struct fanout_job *tail;
+    int *members;                       /* Open slots owned by this worker */
+    int num_members;
+    int *dirty;                         /* Slots queued to during the current job batch */
+    int num_dirty;
+    struct metrics_worker *stats;       /* Counters of this worker in the metrics segment */
+};
+
+struct fanout_pool {
+    struct fanout_config config;
+    int num_workers;
+    int max_clients;
+    struct fanout_worker *workers;
+    struct delivery *clients;           /* Indexed by registry slot */
+    struct metrics_segment *metrics;    /* Where the workers publish their counters and client lag */
+    int pending;                        /* Jobs posted and not yet run by a worker */
+    uint64_t posted;                    /* Jobs posted so far, only touched by the server thread */
+    int reap_fd;                        /* eventfd, readable when dead clients are pending */
+    pthread_mutex_t reap_lock;
+    struct fanout_dead *dead;           /* Dead clients not yet collected */
+    int num_dead;
+    int max_dead;
+};
+
+int fanout_init(struct fanout_pool *pool, const struct fanout_config *config, int max_clients,
+                struct metrics_segment *metrics);
+void fanout_destroy(struct fanout_pool *pool);
+struct fanout_msg *fanout_msg_new(const void *data, size_t len);
+void fanout_msg_put(struct fanout_msg *msg);
+void fanout_open(struct fanout_pool *pool, int slot, unsigned int gen, const char *user_name, int sock);
+void fanout_close(struct fanout_pool *pool, int slot);
+void fanout_send(struct fanout_pool *pool, int slot, struct fanout_msg *msg);
+void fanout_broadcast(struct fanout_pool *pool, struct fanout_msg *msg, int exclude_slot);
+void fanout_heartbeat(struct fanout_pool *pool, struct fanout_msg *msg);
+void fanout_multicast(struct fanout_pool *pool, struct fanout_msg *msg, const uint64_t *members, int words,
+                      int exclude_slot);
+void fanout_ack(struct fanout_pool *pool, int slot, const uint32_t *acked);
+void fanout_resend(struct fanout_pool *pool, int slot, int lane, uint32_t first, uint32_t count);
+void fanout_report_lag(struct fanout_pool *pool);
+int fanout_pending(struct fanout_pool *pool);
+int fanout_reap(struct fanout_pool *pool, struct fanout_dead *dead, int max);
+
+#endif
@@ -0,0 +1,179 @@
+/* Live metrics of the chat server in shared memory.
+ *
+ * Every shard publishes its counters and histograms in a POSIX shared-memory
+ * segment (/hdp38_njs76_chat_metrics, .n for shard n > 0) that chatstat maps
+ * read-only. The server thread and each fan-out worker write their own
+ * block, and each client slot is written by the worker owning it, so no
+ * writer ever waits on another or on a reader. A block is guarded by a
+ * seqlock: a reader copies it and tries again if a writer was busy with it.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#define _GNU_SOURCE // For sched_yield() and shm_open()
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "metrics.h"
+
+#define READ_TRIES 1000 /* Copies tried before a block is taken to be abandoned mid-write */
+
+static size_t
+segment_size(int num_workers, int max_clients)
+{
+    return sizeof(struct metrics_segment) + num_workers * sizeof(struct metrics_worker) +
+           max_clients * sizeof(struct metrics_client);
+}
+
+/* Create the zeroed segment of a shard, replacing one left by an earlier server */
+int metrics_create(struct metrics *m, int shard, int num_workers, int max_clients)
+{
+    char name[MESSAGE_LEN];
+    struct timespec now;
+    int fd;
+
+    metrics_shm_name(name, sizeof(name), shard);
+    m->size = segment_size(num_workers, max_clients);
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (ftruncate(fd, m->size) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    m->seg = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m->seg == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    /* ftruncate zero-fills, so every counter starts at 0 */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    m->seg->version = METRICS_VERSION;
+    m->seg->shard = shard;
+    m->seg->num_workers = num_workers;
+    m->seg->max_clients = max_clients;
+    m->seg->pid = getpid();
+    m->seg->start_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    __atomic_store_n(&m->seg->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Map the segment of a running shard read-only. Returns -1 if there is none. */
+int metrics_attach(struct metrics *m, int shard)
+{
+    char name[MESSAGE_LEN];
+    struct stat st;
+    int fd;
+
+    metrics_shm_name(name, sizeof(name), shard);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct metrics_segment))
+    {
+        close(fd);
+        return -1;
+    }
+    m->size = st.st_size;
+    m->seg = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m->seg == MAP_FAILED)
+    {
+        return -1;
+    }
+    if (__atomic_load_n(&m->seg->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+        m->seg->version != METRICS_VERSION ||
+        segment_size(m->seg->num_workers, m->seg->max_clients) != m->size)
+    {
+        metrics_detach(m);
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_detach(struct metrics *m)
+{
+    munmap(m->seg, m->size);
+    m->seg = NULL;
+}
+
+/* Copy a consistent snapshot of a block, whose first member is its seqlock.
+ * Returns -1 if its writer seems to have died in the middle of an update.
+ */
+int metrics_read(void *dst, const void *block, size_t size)
+{
+    const uint32_t *seq = block;
+    uint32_t before;
+
+    for (int i = 0; i < READ_TRIES; i++)
+    {
+        before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (before & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(dst, block, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Smallest value in a bucket */
+static uint64_t
+bucket_floor(int i)
+{
+    int sub = 1 << METRICS_SUB_BITS;
+
+    if (i < sub)
+    {
+        return i;
+    }
+    return (uint64_t)(sub + i % sub) << (i / sub - 1);
+}
+
+/* Value below which the given fraction of the recorded values fall, to within a bucket */
+uint64_t metrics_hist_value(const struct metrics_hist *h, double quantile)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t value;
+
+    if (h->count == 0)
+    {
+        return 0;
+    }
+    rank = (uint64_t)(quantile * h->count);
+    if (rank >= h->count)
+    {
+        rank = h->count - 1;
+    }
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+        {
+            /* Report the top of the bucket, but never more than was seen */
+            value = i + 1 < METRICS_HIST_BUCKETS ? bucket_floor(i + 1) - 1 : h->max;
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,160 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "msg_structure.h"
+
+#define METRICS_NAME "/hdp38_njs76_chat_metrics"
+#define METRICS_MAGIC 0x4d545243u       /* "CRTM" */
+#define METRICS_VERSION 2
+#define METRICS_TYPES 16                /* Counters of received frames, indexed by MSG_* */
+#define METRICS_SUB_BITS 3              /* Histogram buckets per power of two are 1 << METRICS_SUB_BITS */
+#define METRICS_HIST_BUCKETS 320        /* Enough for values up to 2^41 */
+
+/* Log-linear histogram: exact below 8, then 8 buckets per power of two, so
+ * a value is known to within 12.5%
+ */
+struct metrics_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRICS_HIST_BUCKETS];
+};
+
+/* Every block below starts with its seqlock and has a single writer, which
+ * makes seq odd while it changes the block. A reader copies the block and
+ * retries if seq was odd or changed meanwhile.
+ */
+
+/* Written by the server thread of a shard */
+struct metrics_server {
+    uint32_t seq;
+    uint32_t clients;                   /* Connected now */
+    uint64_t posted;                    /* Fan-out jobs handed to the workers */
+    uint64_t received[METRICS_TYPES];   /* Client frames by type; unknown types count as 0 */
+    uint64_t joins;
+    uint64_t leaves;                    /* Clients gone for any reason */
+    uint64_t full;                      /* Joins turned away */
+    uint64_t rejected;                  /* Chat messages over a rate limit or the admission limit */
+    struct metrics_hist fanout;         /* Recipients per broadcast or channel post */
+} __attribute__((aligned(64)));
+
+/* Written by one fan-out worker */
+struct metrics_worker {
+    uint32_t seq;
+    uint32_t pad;
+    uint64_t jobs;                      /* Fan-out jobs run */
+    uint64_t frames;                    /* Frames written to client MQs and sockets */
+    uint64_t messages;                  /* Messages in those frames */
+    uint64_t stalls;                    /* Client MQ or socket found full */
+    uint64_t dropped;                   /* Messages discarded by the slow-consumer policy */
+    uint64_t resent;                    /* Messages sent again on a nack */
+    uint64_t lost;                      /* Messages asked for again that were no longer kept */
+    struct metrics_hist send_ns;        /* Time spent in each mq_send() or sendmmsg() */
+} __attribute__((aligned(64)));
+
+/* Lag of the client in one registry slot, written by the worker owning it */
+struct metrics_client {
+    uint32_t seq;
+    uint32_t open;                      /* 1 while the slot has a client */
+    char user_name[USER_NAME_LEN];
+    int32_t queued;                     /* Outbound queue right now */
+    int32_t max_queued;
+    uint64_t sent;
+    uint64_t dropped;
+    uint64_t stalls;
+    uint64_t resent;
+} __attribute__((aligned(64)));
+
+/* Shared-memory segment of one shard: the header, the server block, one
+ * block per worker and one per client slot
+ */
+struct metrics_segment {
+    uint32_t magic;                     /* Written last */
+    uint32_t version;
+    int32_t shard;
+    int32_t num_workers;
+    int32_t max_clients;
+    int32_t pid;
+    int64_t start_ns;                   /* Monotonic time the server started */
+    struct metrics_server server;
+    struct metrics_worker workers[];
+};
+
+struct metrics {
+    struct metrics_segment *seg;
+    size_t size;
+};
+
+int metrics_create(struct metrics *m, int shard, int num_workers, int max_clients);
+int metrics_attach(struct metrics *m, int shard);
+void metrics_detach(struct metrics *m);
+int metrics_read(void *dst, const void *block, size_t size);
+uint64_t metrics_hist_value(const struct metrics_hist *h, double quantile);
+
+/* Name of the segment of a shard */
+static inline void
+metrics_shm_name(char *out, size_t out_len, int shard)
+{
+    if (shard == 0)
+    {
+        snprintf(out, out_len, "%s", METRICS_NAME);
+    }
+    else
+    {
+        snprintf(out, out_len, "%s.%d", METRICS_NAME, shard);
+    }
+}
+
+static inline struct metrics_client *
+metrics_client(struct metrics_segment *seg, int slot)
+{
+    return (struct metrics_client *)&seg->workers[seg->num_workers] + slot;
+}
+
+/* Make seq odd before the block changes */
+static inline void
+metrics_begin(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Make seq even again once the block is consistent */
+static inline void
+metrics_end(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline int
+metrics_bucket(uint64_t value)
+{
+    int e;
+    int i;
+
+    if (value < (1u << METRICS_SUB_BITS))
+    {
+        return (int)value;
+    }
+    e = 63 - __builtin_clzll(value);
+    i = (e - METRICS_SUB_BITS + 1) * (1 << METRICS_SUB_BITS) +
+        (int)((value >> (e - METRICS_SUB_BITS)) & ((1u << METRICS_SUB_BITS) - 1));
+    return i < METRICS_HIST_BUCKETS ? i : METRICS_HIST_BUCKETS - 1;
+}
+
+static inline void
+metrics_hist_add(struct metrics_hist *h, uint64_t value)
+{
+    h->buckets[metrics_bucket(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+#endif
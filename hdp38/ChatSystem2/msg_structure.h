@@ -1,23 +1,410 @@
 #ifndef _MSG_STRUCTURE_H_
 #define _MSG_STRUCTURE_H_
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
 #define USER_NAME_LEN 32
 #define MESSAGE_LEN 256
+#define MESSAGE_MAX 65536               /* Longest message text; text that does not fit in a frame goes in fragments */
+
+/* Wire format shared by the client and the server.
+ *
+ * Every message is a small fixed header followed by only the payload bytes
+ * that are used. Strings in the payload are length-prefixed with one byte;
+ * the message text is whatever follows the last string.
+ *
+ * Clients are named only when they join. The join acknowledgement hands the
+ * client a session id and every later frame refers to the sender, and to the
+ * recipient of a private message, by id. Deliveries still carry the sender's
+ * name so the client can display it.
+ *
+ * A batch frame packs several complete frames into one queue message so a
+ * burst costs one mq_send instead of one per message. Each packed frame is
+ * preceded by its size as a uint16_t. Batches are never nested.
+ *
+ * With -u the same frames travel over a SOCK_SEQPACKET Unix-domain socket
+ * per client instead of the client MQ, one frame per packet. The sockets do
+ * not count against the system-wide mqueue limits.
+ *
+ * A text too long for one frame is sent as fragments: frames of the same type
+ * with the MSG_FRAGMENT flag, each with a fragment header ahead of the rest of
+ * its payload and carrying the next slice of the text. The server routes every
+ * fragment like a message of its own, so other traffic interleaves with them,
+ * and the recipient puts the text back together by sender and message id.
+ *
+ * The server numbers the chat frames it sends each client, one sequence per
+ * priority lane since the lanes overtake each other on purpose. Within a
+ * lane frames arrive in order, so a number skipped means a frame was lost,
+ * most likely dropped for a slow client. The client asks for it again with a
+ * nack and acknowledges what it has received with an ack, so the server only
+ * has to keep recent frames that are not yet acknowledged.
+ */
+#define WIRE_VERSION 4
+#define FRAME_MAX 512                   /* mq_msgsize of every chat queue */
+
+/* Frame types */
+#define MSG_JOIN 1                      /* client ---> server: [user name][u32 process ID] */
+#define MSG_LEAVE 2                     /* client ---> server: no payload */
+#define MSG_BROADCAST 3                 /* client ---> server: text
+                                           server ---> client: [sender name] text */
+#define MSG_PRIVATE 4                   /* client ---> server: text to target, or
+                                                              [recipient name] text if target is 0
+                                           server ---> client: [sender name] text */
+#define MSG_HEARTBEAT 5                 /* both ways: no payload */
+#define MSG_NOTICE 6                    /* server ---> client: text from the server itself,
+                                           target is the id the notice is about, if any */
+#define MSG_FRAME_BATCH 7               /* both ways: [u16 size][frame][u16 size][frame]... */
+#define MSG_JOIN_ACK 8                  /* server ---> client: target is the new session id */
+#define MSG_CHANNEL_JOIN 9              /* client ---> server: [channel name] */
+#define MSG_CHANNEL_LEAVE 10            /* client ---> server: [channel name] */
+#define MSG_CHANNEL_POST 11             /* client ---> server: [channel name] text
+                                           server ---> client: [sender name][channel name] text */
+#define MSG_ACK 12                      /* client ---> server: [u32 seq per lane], the last received in order
+                                           server ---> client: [u32 seq per lane], the last sent */
+#define MSG_NACK 13                     /* client ---> server: [u32 lane][u32 first seq][u32 count] to send again
+                                           server ---> client: the same for frames that are gone for good */
+#define MSG_FRAGMENT 0x80               /* Flag on a broadcast, private message or channel post:
+                                           [struct msg_fragment] then the payload above with a slice of the text */
+
+#define SESSION_NONE 0                  /* Sender of server frames and of a join */
+
+/* The server may run as several shards, each owning the users whose name
+ * hashes to it. Shard 0 listens on SERVER_NAME and shard n on SERVER_NAME.n;
+ * a client counts the shard queues and sends everything to the one of its name.
+ *
+ * With the socket transport a shard also listens on a Unix-domain
+ * SOCK_SEQPACKET socket in the abstract namespace, named like its queue.
+ * Every record on the connection is one frame, in both directions.
+ */
+#define SERVER_NAME "/hdp38_njs76_chat_server"
+#define SHARD_MAX 16
 
-/* Structure of the client ---> server message */
-struct client_msg {
-    int client_pid;                     /* Process ID of the client contacting the server */
-    char user_name[USER_NAME_LEN];      /* User name or handle of the client chat user */
-    int broadcast;                       /* 1 if message must be broadcasted, 0 if preivate */
-    char priv_user_name[USER_NAME_LEN]; /* Intended party in case of private message */
-    char msg[MESSAGE_LEN];              /* Message */
-    int control;                        /* Flag indicating control msg, say connect or disconnect */
+/* Liveness. The server only sends a heartbeat to clients that got no other
+ * traffic during the interval, and a client answers with a heartbeat of its
+ * own when it has not sent anything for an interval. Either side gives up on
+ * the other after HEARTBEAT_MISSES silent intervals.
+ */
+#define HEARTBEAT_INTERVAL 5            /* Seconds */
+#define HEARTBEAT_MISSES 3
+
+/* mq_send() priorities. mq_receive() returns the oldest message of the highest
+ * priority first, so joins, leaves and heartbeats get through a flood of
+ * broadcasts and private messages overtake broadcasts. Fragments of long
+ * messages come last, so a long paste never holds up the chat around it.
+ */
+#define PRIO_BULK 0
+#define PRIO_BROADCAST 1
+#define PRIO_PRIVATE 2
+#define PRIO_CONTROL 3
+
+/* Chat frames to a client are numbered per lane, the lane being their
+ * priority; control frames are not numbered and carry seq 0
+ */
+#define SEQ_LANES PRIO_CONTROL
+
+struct msg_hdr {
+    uint8_t version;                    /* WIRE_VERSION */
+    uint8_t type;                       /* One of MSG_* */
+    uint16_t len;                       /* Payload bytes following the header */
+    uint32_t sender;                    /* Session id of the originating client, SESSION_NONE for the server */
+    uint32_t target;                    /* Session id of the recipient, SESSION_NONE if unused */
+    uint32_t seq;                       /* Number of a frame to a client in its lane, counted from 1; 0 if unnumbered */
 };
 
-/* Structure of the server ---> client message */
-struct server_msg {
-    char sender_name[USER_NAME_LEN];    /* User name of the originating chat user */
-    char msg[MESSAGE_LEN];              /* Message */
+#define FRAME_PAYLOAD_MAX (FRAME_MAX - sizeof(struct msg_hdr))
+
+/* Leads the payload of a fragment */
+struct msg_fragment {
+    uint32_t id;                        /* Message number, counted per sender from 1 */
+    uint32_t total;                     /* Bytes of the whole text */
+    uint32_t offset;                    /* Where in the text this fragment's slice goes */
 };
 
+/* Text per fragment, leaving room for the names the server adds */
+#define FRAGMENT_TEXT_MAX (FRAME_PAYLOAD_MAX - sizeof(struct msg_fragment) - 2 * USER_NAME_LEN)
+
+/* A frame being built or parsed */
+struct frame {
+    union {
+        struct msg_hdr hdr;
+        char buf[FRAME_MAX];
+    } u;
+    size_t pos;                         /* Read offset into the payload */
+};
+
+static inline void
+frame_init(struct frame *f, uint8_t type, uint32_t sender)
+{
+    memset(&f->u.hdr, 0, sizeof(f->u.hdr));
+    f->u.hdr.version = WIRE_VERSION;
+    f->u.hdr.type = type;
+    f->u.hdr.sender = sender;
+    f->pos = 0;
+}
+
+/* Total bytes to hand to mq_send() */
+static inline size_t
+frame_size(const struct frame *f)
+{
+    return sizeof(struct msg_hdr) + f->u.hdr.len;
+}
+
+static inline char *
+frame_payload(struct frame *f)
+{
+    return f->u.buf + sizeof(struct msg_hdr);
+}
+
+/* Append a length-prefixed string, truncated to fit */
+static inline void
+frame_put_str(struct frame *f, const char *s)
+{
+    size_t len = 0;
+
+    while (len < USER_NAME_LEN - 1 && s[len] != '\0')
+    {
+        len++;
+    }
+    if (f->u.hdr.len + 1 + len > FRAME_PAYLOAD_MAX)
+    {
+        return;
+    }
+    frame_payload(f)[f->u.hdr.len] = (char)len;
+    memcpy(frame_payload(f) + f->u.hdr.len + 1, s, len);
+    f->u.hdr.len += 1 + len;
+}
+
+/* Append a 32-bit number */
+static inline void
+frame_put_u32(struct frame *f, uint32_t value)
+{
+    if (f->u.hdr.len + sizeof(value) > FRAME_PAYLOAD_MAX)
+    {
+        return;
+    }
+    memcpy(frame_payload(f) + f->u.hdr.len, &value, sizeof(value));
+    f->u.hdr.len += sizeof(value);
+}
+
+/* Append the message text, truncated to fit */
+static inline void
+frame_put_text(struct frame *f, const char *text, size_t len)
+{
+    if (len > FRAME_PAYLOAD_MAX - f->u.hdr.len)
+    {
+        len = FRAME_PAYLOAD_MAX - f->u.hdr.len;
+    }
+    memcpy(frame_payload(f) + f->u.hdr.len, text, len);
+    f->u.hdr.len += len;
+}
+
+/* Start the payload of a fragment, before anything else is put in */
+static inline void
+frame_put_fragment(struct frame *f, uint32_t id, uint32_t total, uint32_t offset)
+{
+    struct msg_fragment frag = {id, total, offset};
+
+    f->u.hdr.type |= MSG_FRAGMENT;
+    frame_put_text(f, (const char *)&frag, sizeof(frag));
+}
+
+/* Check a received frame. Returns 0 if it is well formed. */
+static inline int
+frame_check(struct frame *f, size_t nr)
+{
+    f->pos = 0;
+    if (nr < sizeof(struct msg_hdr) || f->u.hdr.version != WIRE_VERSION ||
+        frame_size(f) != nr)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a length-prefixed string into out (USER_NAME_LEN bytes). Returns -1 if malformed. */
+static inline int
+frame_get_str(struct frame *f, char *out)
+{
+    size_t len;
+
+    if (f->pos >= f->u.hdr.len)
+    {
+        return -1;
+    }
+    len = (unsigned char)frame_payload(f)[f->pos];
+    if (len >= USER_NAME_LEN || f->pos + 1 + len > f->u.hdr.len)
+    {
+        return -1;
+    }
+    memcpy(out, frame_payload(f) + f->pos + 1, len);
+    out[len] = '\0';
+    f->pos += 1 + len;
+    return 0;
+}
+
+/* Read the fragment header of a fragment and zero frag for any other frame.
+ * Returns -1 if the frame is a malformed fragment or cannot be one.
+ */
+static inline int
+frame_get_fragment(struct frame *f, struct msg_fragment *frag)
+{
+    memset(frag, 0, sizeof(*frag));
+    if (!(f->u.hdr.type & MSG_FRAGMENT))
+    {
+        return 0;
+    }
+    switch (f->u.hdr.type & ~MSG_FRAGMENT)
+    {
+    case MSG_BROADCAST:
+    case MSG_PRIVATE:
+    case MSG_CHANNEL_POST:
+        break;
+    default:
+        return -1;
+    }
+    if (f->pos + sizeof(*frag) > f->u.hdr.len)
+    {
+        return -1;
+    }
+    memcpy(frag, frame_payload(f) + f->pos, sizeof(*frag));
+    f->pos += sizeof(*frag);
+    if (frag->total == 0 || frag->offset >= frag->total || frag->total > MESSAGE_MAX)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a 32-bit number. Returns -1 if malformed. */
+static inline int
+frame_get_u32(struct frame *f, uint32_t *value)
+{
+    if (f->pos + sizeof(*value) > f->u.hdr.len)
+    {
+        return -1;
+    }
+    memcpy(value, frame_payload(f) + f->pos, sizeof(*value));
+    f->pos += sizeof(*value);
+    return 0;
+}
+
+/* Copy the rest of the payload into out as a string of at most out_len - 1 bytes */
+static inline void
+frame_get_text(struct frame *f, char *out, size_t out_len)
+{
+    size_t len = f->u.hdr.len - f->pos;
+
+    if (len > out_len - 1)
+    {
+        len = out_len - 1;
+    }
+    memcpy(out, frame_payload(f) + f->pos, len);
+    out[len] = '\0';
+    f->pos += len;
+}
+
+/* Name of the server MQ of a shard */
+static inline void
+shard_server_name(char *out, size_t out_len, int shard)
+{
+    if (shard == 0)
+    {
+        snprintf(out, out_len, "%s", SERVER_NAME);
+    }
+    else
+    {
+        snprintf(out, out_len, "%s.%d", SERVER_NAME, shard);
+    }
+}
+
+/* Address of the listening socket of a shard. Returns the address length. */
+static inline socklen_t
+shard_socket_addr(struct sockaddr_un *addr, int shard)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    shard_server_name(addr->sun_path + 1, sizeof(addr->sun_path) - 1, shard); /* Leading '\0': abstract */
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
+/* Shard owning a user name (FNV-1a) */
+static inline int
+shard_of(const char *user_name, int num_shards)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*user_name)
+    {
+        hash ^= (unsigned char)*user_name++;
+        hash *= 16777619u;
+    }
+    return (int)(hash % (uint32_t)num_shards);
+}
+
+static inline unsigned int
+frame_priority(uint8_t type)
+{
+    if (type & MSG_FRAGMENT)
+    {
+        return PRIO_BULK;
+    }
+    switch (type)
+    {
+    case MSG_BROADCAST:
+    case MSG_CHANNEL_POST:
+        return PRIO_BROADCAST;
+    case MSG_PRIVATE:
+        return PRIO_PRIVATE;
+    default:
+        return PRIO_CONTROL;
+    }
+}
+
+/* Append a complete frame to a batch. Returns -1 if it does not fit. */
+static inline int
+frame_batch_add(struct frame *batch, const void *data, size_t len)
+{
+    uint16_t size = len;
+
+    if (batch->u.hdr.len + sizeof(size) + len > FRAME_PAYLOAD_MAX)
+    {
+        return -1;
+    }
+    memcpy(frame_payload(batch) + batch->u.hdr.len, &size, sizeof(size));
+    memcpy(frame_payload(batch) + batch->u.hdr.len + sizeof(size), data, len);
+    batch->u.hdr.len += sizeof(size) + len;
+    return 0;
+}
+
+/* Copy the next frame of a batch into out. Returns -1 at the end of the
+ * batch or if the rest of it is malformed.
+ */
+static inline int
+frame_batch_next(struct frame *batch, struct frame *out)
+{
+    uint16_t size;
+
+    if (batch->pos + sizeof(size) > batch->u.hdr.len)
+    {
+        return -1;
+    }
+    memcpy(&size, frame_payload(batch) + batch->pos, sizeof(size));
+    if (batch->pos + sizeof(size) + size > batch->u.hdr.len)
+    {
+        return -1;
+    }
+    memcpy(out->u.buf, frame_payload(batch) + batch->pos + sizeof(size), size);
+    batch->pos += sizeof(size) + size;
+    if (frame_check(out, size) == -1 || out->u.hdr.type == MSG_FRAME_BATCH)
+    {
+        return -1;
+    }
+    return 0;
+}
+
 #endif
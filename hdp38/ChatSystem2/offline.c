@@ -0,0 +1,433 @@
+/* Offline message store of the chat server.
+ *
+ * Private messages for users that are not connected are appended to a log
+ * of fixed-size segment files mapped into memory. An in-memory index lists
+ * the pending records of each recipient; it is rebuilt by scanning the
+ * segments when the server starts. Appends only touch memory and
+ * offline_commit() flushes everything appended since the last call with one
+ * msync, so a burst of stored messages costs one disk flush rather than one
+ * per message. When a user joins, its messages are handed back oldest first
+ * and marked delivered, and segments with nothing left to deliver are
+ * deleted.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#define _POSIX_C_SOURCE 200809L // For ftruncate(), msync() and readdir()
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "offline.h"
+
+/* FNV-1a hash of the recipient name */
+static unsigned int
+hash_name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t
+record_size(size_t len)
+{
+    return sizeof(struct offline_record) + ((len + 7) & ~(size_t)7);
+}
+
+static void
+segment_path(const struct offline_store *store, unsigned int id, char *path, size_t path_len)
+{
+    snprintf(path, path_len, "%s/segment-%06u.log", store->dir, id);
+}
+
+static struct offline_segment *
+find_segment(struct offline_store *store, unsigned int id)
+{
+    int lo = 0, hi = store->num_segments - 1, mid;
+
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if (store->segments[mid].id == id)
+        {
+            return &store->segments[mid];
+        }
+        if (store->segments[mid].id < id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+/* Map a segment file, creating it if needed, and add it after the existing ones */
+static struct offline_segment *
+map_segment(struct offline_store *store, unsigned int id)
+{
+    struct offline_segment *segment;
+    char path[512];
+    char *base;
+    int fd;
+
+    segment_path(store, id, path, sizeof(path));
+    fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        perror("open");
+        return NULL;
+    }
+    /* Extends a new file with zeros, which reads as "no more records" */
+    if (ftruncate(fd, OFFLINE_SEGMENT_SIZE) == -1)
+    {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, OFFLINE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    if (store->num_segments == store->max_segments)
+    {
+        store->max_segments = store->max_segments ? 2 * store->max_segments : 4;
+        store->segments = realloc(store->segments, store->max_segments * sizeof(struct offline_segment));
+        if (store->segments == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    segment = &store->segments[store->num_segments++];
+    memset(segment, 0, sizeof(*segment));
+    segment->id = id;
+    segment->base = base;
+    return segment;
+}
+
+static struct offline_box *
+find_box(struct offline_store *store, const char *recipient, int create)
+{
+    struct offline_box **bucket = &store->buckets[hash_name(recipient) & (OFFLINE_BUCKETS - 1)];
+    struct offline_box *box;
+
+    for (box = *bucket; box != NULL; box = box->next)
+    {
+        if (strcmp(box->recipient, recipient) == 0)
+        {
+            return box;
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+
+    box = calloc(1, sizeof(*box));
+    if (box == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(box->recipient, sizeof(box->recipient), "%s", recipient);
+    box->next = *bucket;
+    *bucket = box;
+    return box;
+}
+
+static void
+free_box(struct offline_store *store, struct offline_box *box)
+{
+    struct offline_box **link = &store->buckets[hash_name(box->recipient) & (OFFLINE_BUCKETS - 1)];
+
+    while (*link != box)
+    {
+        link = &(*link)->next;
+    }
+    *link = box->next;
+    free(box->refs);
+    free(box);
+}
+
+static void
+box_push(struct offline_box *box, unsigned int segment, uint32_t offset)
+{
+    if (box->head + box->count == box->cap)
+    {
+        /* Reuse the space of replayed refs before growing */
+        memmove(box->refs, box->refs + box->head, box->count * sizeof(struct offline_ref));
+        box->head = 0;
+        if (box->count == box->cap)
+        {
+            box->cap = box->cap ? 2 * box->cap : 8;
+            box->refs = realloc(box->refs, box->cap * sizeof(struct offline_ref));
+            if (box->refs == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    box->refs[box->head + box->count].segment = segment;
+    box->refs[box->head + box->count].offset = offset;
+    box->count++;
+}
+
+/* Index the undelivered records of a segment mapped at startup */
+static void
+scan_segment(struct offline_store *store, struct offline_segment *segment)
+{
+    struct offline_record *rec;
+    size_t offset = 0;
+
+    while (offset + sizeof(*rec) <= OFFLINE_SEGMENT_SIZE)
+    {
+        rec = (struct offline_record *)(segment->base + offset);
+        if (rec->magic != OFFLINE_MAGIC || rec->len > FRAME_MAX ||
+            offset + record_size(rec->len) > OFFLINE_SEGMENT_SIZE)
+        {
+            break; /* End of the log, or a record torn by a crash */
+        }
+        rec->recipient[USER_NAME_LEN - 1] = '\0';
+        if (!rec->delivered)
+        {
+            box_push(find_box(store, rec->recipient, 1), segment->id, offset);
+            segment->live++;
+        }
+        offset += record_size(rec->len);
+    }
+    segment->used = segment->synced = offset;
+}
+
+/* Delete segments other than the one being appended to that have nothing left to deliver */
+static void
+collect_segments(struct offline_store *store)
+{
+    char path[512];
+    int i = 0;
+
+    while (i < store->num_segments - 1)
+    {
+        if (store->segments[i].live > 0)
+        {
+            i++;
+            continue;
+        }
+        munmap(store->segments[i].base, OFFLINE_SEGMENT_SIZE);
+        segment_path(store, store->segments[i].id, path, sizeof(path));
+        if (unlink(path) == -1)
+        {
+            perror("unlink");
+        }
+        memmove(&store->segments[i], &store->segments[i + 1],
+                (store->num_segments - i - 1) * sizeof(struct offline_segment));
+        store->num_segments--;
+    }
+}
+
+static int
+compare_ids(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Open the store in dir, creating the directory if needed, and index what is pending */
+int offline_open(struct offline_store *store, const char *dir)
+{
+    struct dirent *entry;
+    unsigned int *ids = NULL;
+    unsigned int id;
+    int num_ids = 0, max_ids = 0;
+    DIR *d;
+
+    memset(store, 0, sizeof(*store));
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    d = opendir(dir);
+    if (d == NULL)
+    {
+        return -1;
+    }
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (sscanf(entry->d_name, "segment-%u.log", &id) != 1)
+        {
+            continue;
+        }
+        if (num_ids == max_ids)
+        {
+            max_ids = max_ids ? 2 * max_ids : 16;
+            ids = realloc(ids, max_ids * sizeof(unsigned int));
+            if (ids == NULL)
+            {
+                closedir(d);
+                return -1;
+            }
+        }
+        ids[num_ids++] = id;
+    }
+    closedir(d);
+
+    qsort(ids, num_ids, sizeof(unsigned int), compare_ids);
+    for (int i = 0; i < num_ids; i++)
+    {
+        if (map_segment(store, ids[i]) == NULL)
+        {
+            free(ids);
+            return -1;
+        }
+        scan_segment(store, &store->segments[store->num_segments - 1]);
+    }
+    free(ids);
+
+    if (store->num_segments == 0 && map_segment(store, 1) == NULL)
+    {
+        return -1;
+    }
+    collect_segments(store);
+    return 0;
+}
+
+void offline_close(struct offline_store *store)
+{
+    struct offline_box *box;
+
+    offline_commit(store);
+    for (int i = 0; i < store->num_segments; i++)
+    {
+        munmap(store->segments[i].base, OFFLINE_SEGMENT_SIZE);
+    }
+    free(store->segments);
+    for (int i = 0; i < OFFLINE_BUCKETS; i++)
+    {
+        while ((box = store->buckets[i]) != NULL)
+        {
+            free_box(store, box);
+        }
+    }
+}
+
+/* Store a frame for a recipient. It is on disk after the next offline_commit(). */
+int offline_append(struct offline_store *store, const char *recipient, const void *frame, size_t len)
+{
+    struct offline_segment *segment = &store->segments[store->num_segments - 1];
+    struct offline_record *rec;
+
+    if (len > FRAME_MAX)
+    {
+        return -1;
+    }
+    if (segment->used + record_size(len) > OFFLINE_SEGMENT_SIZE)
+    {
+        /* Rotate; flush the full segment first so it never needs syncing again */
+        offline_commit(store);
+        segment = map_segment(store, segment->id + 1);
+        if (segment == NULL)
+        {
+            return -1;
+        }
+    }
+
+    rec = (struct offline_record *)(segment->base + segment->used);
+    rec->len = len;
+    rec->delivered = 0;
+    snprintf(rec->recipient, sizeof(rec->recipient), "%s", recipient);
+    memcpy(rec + 1, frame, len);
+    rec->magic = OFFLINE_MAGIC; /* Complete */
+
+    box_push(find_box(store, recipient, 1), segment->id, segment->used);
+    segment->live++;
+    segment->used += record_size(len);
+    return 0;
+}
+
+/* Return the number of messages waiting for a recipient */
+int offline_pending(struct offline_store *store, const char *recipient)
+{
+    struct offline_box *box = find_box(store, recipient, 0);
+
+    return box != NULL ? box->count : 0;
+}
+
+/* Copy the oldest pending messages of a recipient into frames, at most
+ * max_frames of them, and mark them delivered. Returns the number copied.
+ */
+int offline_replay(struct offline_store *store, const char *recipient, struct frame *frames, int max_frames)
+{
+    struct offline_box *box = find_box(store, recipient, 0);
+    struct offline_segment *segment;
+    struct offline_record *rec;
+    struct offline_ref *ref;
+    int n = 0;
+
+    if (box == NULL)
+    {
+        return 0;
+    }
+
+    while (box->count > 0 && n < max_frames)
+    {
+        ref = &box->refs[box->head];
+        segment = find_segment(store, ref->segment);
+        rec = (struct offline_record *)(segment->base + ref->offset);
+        memcpy(frames[n++].u.buf, rec + 1, rec->len);
+        rec->delivered = 1;
+        segment->live--;
+        box->head++;
+        box->count--;
+    }
+
+    if (box->count == 0)
+    {
+        free_box(store, box);
+    }
+    collect_segments(store);
+    return n;
+}
+
+/* Flush every record appended since the last commit with one msync per segment touched */
+void offline_commit(struct offline_store *store)
+{
+    struct offline_segment *segment;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start;
+
+    for (int i = 0; i < store->num_segments; i++)
+    {
+        segment = &store->segments[i];
+        if (segment->used == segment->synced)
+        {
+            continue;
+        }
+        start = segment->synced & ~(page - 1);
+        if (msync(segment->base + start, segment->used - start, MS_SYNC) == -1)
+        {
+            perror("msync");
+        }
+        segment->synced = segment->used;
+    }
+}
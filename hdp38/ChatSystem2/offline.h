@@ -0,0 +1,61 @@
+#ifndef _OFFLINE_H_
+#define _OFFLINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "msg_structure.h"
+
+#define OFFLINE_SEGMENT_SIZE (1 << 20)  /* Bytes per log segment file */
+#define OFFLINE_BUCKETS 256             /* Recipient index hash buckets, power of two */
+#define OFFLINE_MAGIC 0x4d41494cu       /* "MAIL", written last so torn records are ignored */
+
+/* Header of one stored message in a segment. The frame follows, padded to 8 bytes. */
+struct offline_record {
+    uint32_t magic;
+    uint32_t len;                       /* Frame bytes */
+    uint32_t delivered;                 /* Set once the message was replayed */
+    uint32_t pad;
+    char recipient[USER_NAME_LEN];
+};
+
+/* A memory-mapped log file. Records are only ever appended. */
+struct offline_segment {
+    unsigned int id;                    /* File is segment-<id>.log */
+    char *base;
+    size_t used;                        /* Bytes of records */
+    size_t synced;                      /* Bytes known to be on disk */
+    int live;                           /* Records not yet delivered */
+};
+
+/* Location of a pending message */
+struct offline_ref {
+    unsigned int segment;
+    uint32_t offset;
+};
+
+/* Pending messages of one recipient, oldest first */
+struct offline_box {
+    struct offline_box *next;           /* Next box in the hash bucket */
+    char recipient[USER_NAME_LEN];
+    struct offline_ref *refs;
+    int head;
+    int count;
+    int cap;
+};
+
+struct offline_store {
+    char dir[256];
+    struct offline_segment *segments;   /* Sorted by id; the last one is appended to */
+    int num_segments;
+    int max_segments;
+    struct offline_box *buckets[OFFLINE_BUCKETS];
+};
+
+int offline_open(struct offline_store *store, const char *dir);
+void offline_close(struct offline_store *store);
+int offline_append(struct offline_store *store, const char *recipient, const void *frame, size_t len);
+int offline_pending(struct offline_store *store, const char *recipient);
+int offline_replay(struct offline_store *store, const char *recipient, struct frame *frames, int max_frames);
+void offline_commit(struct offline_store *store);
+
+#endif
@@ -0,0 +1,49 @@
+/* Token buckets limiting how fast a client may send chat messages.
+ *
+ * A bucket gains rate tokens per second up to burst, and every message takes
+ * one. A client sending steadily below the rate is never held up, and a
+ * short burst after a quiet spell goes through, but a client sending in a
+ * loop gets no more than the rate.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#include "ratelimit.h"
+
+void rate_limit_init(struct rate_limit *limit, double rate, double burst_seconds)
+{
+    limit->rate = rate;
+    limit->burst = rate * burst_seconds;
+    if (limit->burst < 1)
+    {
+        limit->burst = 1;
+    }
+}
+
+/* Start a bucket full */
+void bucket_init(struct token_bucket *bucket, const struct rate_limit *limit, int64_t now_ns)
+{
+    bucket->tokens = limit->burst;
+    bucket->last_ns = now_ns;
+}
+
+/* Take a token for one message. Returns -1 if the bucket is empty. */
+int bucket_take(struct token_bucket *bucket, const struct rate_limit *limit, int64_t now_ns)
+{
+    if (limit->rate <= 0)
+    {
+        return 0;
+    }
+    bucket->tokens += (now_ns - bucket->last_ns) * limit->rate / 1e9;
+    if (bucket->tokens > limit->burst)
+    {
+        bucket->tokens = limit->burst;
+    }
+    bucket->last_ns = now_ns;
+
+    if (bucket->tokens < 1)
+    {
+        return -1;
+    }
+    bucket->tokens -= 1;
+    return 0;
+}
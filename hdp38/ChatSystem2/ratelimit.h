@@ -0,0 +1,22 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+
+/* Rate a bucket refills at and how much it can save up */
+struct rate_limit {
+    double rate;                        /* Messages per second, 0 for no limit */
+    double burst;                       /* Most messages sent back to back after a quiet spell */
+};
+
+/* Allowance of one client for one kind of message */
+struct token_bucket {
+    double tokens;
+    int64_t last_ns;                    /* Monotonic time of the last refill */
+};
+
+void rate_limit_init(struct rate_limit *limit, double rate, double burst_seconds);
+void bucket_init(struct token_bucket *bucket, const struct rate_limit *limit, int64_t now_ns);
+int bucket_take(struct token_bucket *bucket, const struct rate_limit *limit, int64_t now_ns);
+
+#endif
@@ -0,0 +1,355 @@
+/* Registry of the clients connected to the chat server.
+ *
+ * Lookups by user name go through an open-addressing hash table so join,
+ * leave and message routing do not scan every slot. Removal uses backward
+ * shift deletion so the table never fills up with tombstones.
+ *
+ * Once joined, clients refer to each other by session id, which maps
+ * straight to a slot without touching the names. A slot remembers who last
+ * left it, so an id a client still holds for a user who has gone can be
+ * turned back into the name to keep an offline message under.
+ *
+ * The server keeps the registry in a named shared-memory segment. If the
+ * server dies, the next one maps the same segment and carries on with the
+ * clients that are still running, under the same session ids. Only the slots
+ * themselves are trusted after a crash; the live array, free stack and hash
+ * table are rebuilt from them.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#define _POSIX_C_SOURCE 200809L // For ftruncate()
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "registry.h"
+
+/* FNV-1a hash of the user name */
+static unsigned int
+hash_name(const char *user_name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*user_name)
+    {
+        hash ^= (unsigned char)*user_name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t
+align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+/* Point the registry at the arrays that follow the header */
+static void
+lay_out(struct registry *reg, int max_clients, unsigned int table_size)
+{
+    char *p = (char *)reg->hdr + align8(sizeof(struct registry_hdr));
+
+    reg->max_clients = max_clients;
+    reg->clients = (struct client *)p;
+    p += align8(max_clients * sizeof(struct client));
+    reg->live = (int *)p;
+    p += align8(max_clients * sizeof(int));
+    reg->free_slots = (int *)p;
+    p += align8(max_clients * sizeof(int));
+    reg->table = (int *)p;
+    reg->table_mask = table_size - 1;
+}
+
+static void
+table_insert(struct registry *reg, int slot)
+{
+    unsigned int pos = hash_name(reg->clients[slot].user_name) & reg->table_mask;
+
+    while (reg->table[pos] != -1)
+    {
+        pos = (pos + 1) & reg->table_mask;
+    }
+    reg->table[pos] = slot;
+}
+
+/* Rebuild everything but the slots, which may have been left half updated
+ * by a server that died in the middle of a join or leave.
+ */
+static void
+rebuild(struct registry *reg)
+{
+    struct client *client;
+
+    for (unsigned int i = 0; i <= reg->table_mask; i++)
+    {
+        reg->table[i] = -1;
+    }
+    reg->hdr->num_clients = 0;
+    for (int slot = 0; slot < reg->max_clients; slot++)
+    {
+        client = &reg->clients[slot];
+        client->user_name[USER_NAME_LEN - 1] = '\0';
+        client->last_name[USER_NAME_LEN - 1] = '\0';
+        client->pidfd = -1; /* Descriptors died with the old server */
+        /* conn_fd is kept only to tell which clients were on a socket */
+        if (client->in_use && (client->user_name[0] == '\0' || registry_find(reg, client->user_name) >= 0))
+        {
+            client->in_use = 0; /* Torn or duplicate entry */
+        }
+        if (client->in_use)
+        {
+            client->live_idx = reg->hdr->num_clients;
+            reg->live[reg->hdr->num_clients++] = slot;
+            table_insert(reg, slot);
+        }
+    }
+
+    /* Hand out low slots first */
+    reg->hdr->num_free = 0;
+    for (int slot = reg->max_clients - 1; slot >= 0; slot--)
+    {
+        if (!reg->clients[slot].in_use)
+        {
+            reg->free_slots[reg->hdr->num_free++] = slot;
+        }
+    }
+}
+
+/* Set up a registry for max_clients. With a shm_name, the registry lives in
+ * that shared-memory segment, and one left by an earlier server with the
+ * same layout is taken over. Returns 1 if it was taken over, 0 if the
+ * registry starts out empty and -1 on error.
+ */
+int registry_init(struct registry *reg, int max_clients, const char *shm_name)
+{
+    struct registry_hdr *hdr;
+    unsigned int table_size = 1;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    if (max_clients > REGISTRY_MAX_CLIENTS)
+    {
+        return -1;
+    }
+
+    /* Keep the load factor at or below one half */
+    while (table_size < 2 * (unsigned int)max_clients)
+    {
+        table_size <<= 1;
+    }
+    size = align8(sizeof(struct registry_hdr)) + align8(max_clients * sizeof(struct client)) +
+           2 * align8(max_clients * sizeof(int)) + table_size * sizeof(int);
+
+    memset(reg, 0, sizeof(*reg));
+    reg->size = size;
+    if (shm_name == NULL)
+    {
+        reg->hdr = calloc(1, size);
+        if (reg->hdr == NULL)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        /* A segment of another size cannot be ours; truncating to zero clears it */
+        if (fstat(fd, &st) == -1 ||
+            ((size_t)st.st_size != size && (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)))
+        {
+            close(fd);
+            return -1;
+        }
+        reg->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (reg->hdr == MAP_FAILED)
+        {
+            reg->hdr = NULL;
+            return -1;
+        }
+        reg->shared = 1;
+    }
+    hdr = reg->hdr;
+    lay_out(reg, max_clients, table_size);
+
+    if (reg->shared && __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == REGISTRY_MAGIC &&
+        hdr->version == REGISTRY_VERSION && hdr->client_size == sizeof(struct client) &&
+        hdr->max_clients == max_clients)
+    {
+        rebuild(reg);
+        return 1;
+    }
+
+    /* Start empty; the magic goes last so a crash here is not mistaken for a registry */
+    __atomic_store_n(&hdr->magic, 0, __ATOMIC_RELAXED);
+    memset(hdr, 0, size);
+    hdr->version = REGISTRY_VERSION;
+    hdr->client_size = sizeof(struct client);
+    hdr->max_clients = max_clients;
+    rebuild(reg);
+    __atomic_store_n(&hdr->magic, REGISTRY_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Release the registry memory. A shared-memory segment stays for the next server. */
+void registry_destroy(struct registry *reg)
+{
+    if (reg->shared)
+    {
+        munmap(reg->hdr, reg->size);
+    }
+    else
+    {
+        free(reg->hdr);
+    }
+    memset(reg, 0, sizeof(*reg));
+}
+
+/* Return the slot of a connected client or -1 if the client is not connected */
+int registry_find(const struct registry *reg, const char *user_name)
+{
+    unsigned int pos = hash_name(user_name) & reg->table_mask;
+    int slot;
+
+    while ((slot = reg->table[pos]) != -1)
+    {
+        if (strcmp(reg->clients[slot].user_name, user_name) == 0)
+        {
+            return slot;
+        }
+        pos = (pos + 1) & reg->table_mask;
+    }
+    return -1;
+}
+
+/* Add a client and return its slot, or -1 if the registry is full.
+ * The caller is expected to check that the name is not already registered.
+ */
+int registry_add(struct registry *reg, const char *user_name, pid_t client_pid)
+{
+    struct client *client;
+    int slot;
+
+    if (reg->hdr->num_free == 0)
+    {
+        return -1;
+    }
+
+    slot = reg->free_slots[--reg->hdr->num_free];
+    client = &reg->clients[slot];
+    snprintf(client->user_name, sizeof(client->user_name), "%s", user_name);
+    client->client_pid = client_pid;
+    client->pidfd = -1;
+    client->conn_fd = -1;
+    client->gen++;
+    client->in_use = 1;
+    client->live_idx = reg->hdr->num_clients;
+    reg->live[reg->hdr->num_clients++] = slot;
+    table_insert(reg, slot);
+    return slot;
+}
+
+/* Remove a client from the registry. The caller releases the client MQ. */
+void registry_remove(struct registry *reg, int slot)
+{
+    struct client *client = &reg->clients[slot];
+    unsigned int pos, next, home;
+    int moved;
+
+    if (!client->in_use)
+    {
+        return;
+    }
+
+    /* Find the table entry of this slot */
+    pos = hash_name(client->user_name) & reg->table_mask;
+    while (reg->table[pos] != slot)
+    {
+        pos = (pos + 1) & reg->table_mask;
+    }
+
+    /* Backward shift deletion: pull later entries of the cluster into the hole
+     * unless that would move them in front of their home position.
+     */
+    next = pos;
+    while (1)
+    {
+        next = (next + 1) & reg->table_mask;
+        if (reg->table[next] == -1)
+        {
+            break;
+        }
+        home = hash_name(reg->clients[reg->table[next]].user_name) & reg->table_mask;
+        if (((next - home) & reg->table_mask) >= ((next - pos) & reg->table_mask))
+        {
+            reg->table[pos] = reg->table[next];
+            pos = next;
+        }
+    }
+    reg->table[pos] = -1;
+
+    /* Swap the last live client into the hole */
+    moved = reg->live[--reg->hdr->num_clients];
+    reg->live[client->live_idx] = moved;
+    reg->clients[moved].live_idx = client->live_idx;
+
+    memcpy(client->last_name, client->user_name, sizeof(client->last_name));
+    client->last_gen = client->gen;
+    memset(client->user_name, '\0', sizeof(client->user_name));
+    client->in_use = 0;
+    reg->free_slots[reg->hdr->num_free++] = slot;
+}
+
+uint32_t registry_session_id(const struct registry *reg, int slot)
+{
+    return ((uint32_t)reg->shard << SESSION_SHARD_SHIFT) | ((reg->clients[slot].gen & 0xfff) << 16) |
+           (uint32_t)(slot + 1);
+}
+
+/* Return the slot of the client holding session id or -1 if the id is stale */
+int registry_find_id(const struct registry *reg, uint32_t id)
+{
+    int slot = (int)(id & 0xffff) - 1;
+
+    if (slot < 0 || slot >= reg->max_clients || !reg->clients[slot].in_use ||
+        registry_session_id(reg, slot) != id)
+    {
+        return -1;
+    }
+    return slot;
+}
+
+/* Return the user name of a session id, even a stale one as long as its
+ * slot has not been reused twice since. NULL if it is not known.
+ */
+const char *registry_name_of_id(const struct registry *reg, uint32_t id)
+{
+    int slot = (int)(id & 0xffff) - 1;
+    const struct client *client;
+
+    if (registry_find_id(reg, id) >= 0)
+    {
+        return reg->clients[slot].user_name;
+    }
+    if (slot < 0 || slot >= reg->max_clients)
+    {
+        return NULL;
+    }
+    client = &reg->clients[slot];
+    if (client->last_name[0] == '\0' ||
+        (((uint32_t)reg->shard << SESSION_SHARD_SHIFT) | ((client->last_gen & 0xfff) << 16) | (uint32_t)(slot + 1)) != id)
+    {
+        return NULL;
+    }
+    return client->last_name;
+}
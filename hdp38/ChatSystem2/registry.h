@@ -0,0 +1,79 @@
+#ifndef _REGISTRY_H_
+#define _REGISTRY_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+#include "msg_structure.h"
+
+#define REGISTRY_NAME "/hdp38_njs76_chat_registry"
+#define REGISTRY_MAGIC 0x52454753u      /* "REGS" */
+#define REGISTRY_VERSION 3              /* Bump whenever the layout of the segment changes */
+
+/* State kept by the server for each connected client */
+struct client {
+    char user_name[USER_NAME_LEN];      /* User name or handle of the client chat user */
+    pid_t client_pid;                   /* Process ID of the client */
+    unsigned int gen;                   /* Bumped every time the slot is reused */
+    int live_idx;                       /* Position of this client in the live array */
+    int in_use;                         /* 1 if the slot holds a connected client */
+    time_t last_seen;                   /* Monotonic time of the last frame from the client */
+    int pidfd;                          /* pidfd of the client process, -1 if not watched */
+    int conn_fd;                        /* Connection of a socket client, -1 for an MQ client */
+    char last_name[USER_NAME_LEN];      /* User who last left the slot, so a stale id still names them */
+    unsigned int last_gen;              /* gen of that user */
+};
+
+/* Start of the registry memory, followed by the slots, the live array, the
+ * free stack and the hash table. A restarted server checks the header before
+ * trusting what an earlier server left in the segment.
+ */
+struct registry_hdr {
+    uint32_t magic;                     /* REGISTRY_MAGIC, written once the rest is set up */
+    uint32_t version;                   /* REGISTRY_VERSION */
+    uint32_t client_size;               /* sizeof(struct client) */
+    int max_clients;
+    int num_clients;                    /* Number of connected clients */
+    int num_free;
+};
+
+/* Registry of connected clients.
+ *
+ * Clients live in a fixed array of slots. An open-addressing hash table
+ * (linear probing) maps user names to slots and a dense array holds the
+ * slots of the live clients so that broadcasts only visit connected users.
+ *
+ * Everything lives in one block of memory, which can be a named shared-memory
+ * segment so that the registry outlives the server process.
+ */
+struct registry {
+    struct registry_hdr *hdr;           /* Start of the block */
+    size_t size;                        /* Bytes in the block */
+    int shared;                         /* 1 if the block is a shared-memory mapping */
+    int shard;                          /* Server shard owning these clients */
+    int max_clients;                    /* Number of slots */
+    struct client *clients;             /* Slots, indexed by slot number */
+    int *live;                          /* Dense array of live slots, hdr->num_clients entries */
+    int *free_slots;                    /* Stack of unused slots, hdr->num_free entries */
+    int *table;                         /* Hash table of slots, -1 if empty */
+    unsigned int table_mask;            /* Table size - 1, size is a power of two */
+};
+
+/* Session ids are (shard << 28) | (generation << 16) | (slot + 1), with the
+ * generation cut to 12 bits, so an id stops matching as soon as its slot is
+ * reused, tells which shard owns the client and is never SESSION_NONE.
+ */
+#define REGISTRY_MAX_CLIENTS 0xfffe
+#define SESSION_SHARD_SHIFT 28
+#define SESSION_SHARD(id) ((int)((id) >> SESSION_SHARD_SHIFT))
+
+int registry_init(struct registry *reg, int max_clients, const char *shm_name);
+void registry_destroy(struct registry *reg);
+int registry_find(const struct registry *reg, const char *user_name);
+int registry_add(struct registry *reg, const char *user_name, pid_t client_pid);
+void registry_remove(struct registry *reg, int slot);
+uint32_t registry_session_id(const struct registry *reg, int slot);
+int registry_find_id(const struct registry *reg, uint32_t id);
+const char *registry_name_of_id(const struct registry *reg, uint32_t id);
+
+#endif
@@ -0,0 +1,235 @@
+/* Links between the shards of the chat server.
+ *
+ * With -k the server forks into several shards, each owning the users whose
+ * name hashes to it (see shard_of() in msg_structure.h). Frames that need
+ * another shard, such as a private message to one of its users or a
+ * broadcast its users must see, travel through a single-producer,
+ * single-consumer ring for every ordered pair of shards in anonymous shared
+ * memory set up before the fork. A shard is woken through its eventfd only
+ * when a ring it reads goes from empty to non-empty.
+ *
+ * A shard never blocks on a full ring, since two shards sending to each other
+ * would deadlock. What does not fit waits in a private backlog, and the
+ * consumer wakes the producer once it has made room.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#define _GNU_SOURCE // For MAP_ANONYMOUS and eventfd
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "shard.h"
+
+static struct shard_link *
+link_between(const struct shard_set *set, int from, int to)
+{
+    return &set->links[from * set->num_shards + to];
+}
+
+static size_t
+msg_size(const struct shard_msg *msg)
+{
+    return offsetof(struct shard_msg, frame) + msg->len;
+}
+
+static void
+wake(const struct shard_set *set, int shard)
+{
+    uint64_t one = 1;
+
+    if (write(set->wake_fds[shard], &one, sizeof(one)) == -1)
+    {
+        perror("write");
+    }
+}
+
+/* Append msg to a link. Returns -1 if the link is full and 1 if the consumer
+ * may have gone to sleep before seeing it and needs a wakeup.
+ */
+static int
+link_push(struct shard_link *link, const struct shard_msg *msg)
+{
+    uint32_t tail = link->tail;
+    uint32_t head = __atomic_load_n(&link->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head == SHARD_LINK_SLOTS)
+    {
+        return -1;
+    }
+    memcpy(&link->slots[tail & (SHARD_LINK_SLOTS - 1)], msg, msg_size(msg));
+    /* Sequentially consistent, paired with shard_receive(): either the
+     * consumer sees the new tail or we see that it emptied the ring.
+     */
+    __atomic_store_n(&link->tail, tail + 1, __ATOMIC_SEQ_CST);
+    head = __atomic_load_n(&link->head, __ATOMIC_SEQ_CST);
+    return head == tail;
+}
+
+/* Push the backlog of a destination until it is empty or the link is full */
+static void
+flush_backlog(struct shard_set *set, int to)
+{
+    struct shard_link *link = link_between(set, set->self, to);
+    struct shard_backlog *entry;
+    int marked = 0;
+    int r;
+
+    while ((entry = set->backlog[to]) != NULL)
+    {
+        r = link_push(link, &entry->msg);
+        if (r == -1)
+        {
+            if (marked)
+            {
+                break;
+            }
+            /* Ask for a wakeup, then look again in case the consumer made room meanwhile */
+            __atomic_store_n(&link->blocked, 1, __ATOMIC_SEQ_CST);
+            marked = 1;
+            continue;
+        }
+        if (r == 1)
+        {
+            wake(set, to);
+        }
+        set->backlog[to] = entry->next;
+        free(entry);
+    }
+    if (set->backlog[to] == NULL)
+    {
+        set->backlog_tail[to] = NULL;
+    }
+}
+
+/* Create the links and wakeup descriptors of num_shards shards. Call before forking them. */
+int shard_setup(struct shard_set *set, int num_shards)
+{
+    memset(set, 0, sizeof(*set));
+    set->num_shards = num_shards;
+    set->links = mmap(NULL, num_shards * num_shards * sizeof(struct shard_link),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (set->links == MAP_FAILED)
+    {
+        return -1;
+    }
+    set->wake_fds = malloc(num_shards * sizeof(int));
+    set->backlog = calloc(num_shards, sizeof(struct shard_backlog *));
+    set->backlog_tail = calloc(num_shards, sizeof(struct shard_backlog *));
+    if (set->wake_fds == NULL || set->backlog == NULL || set->backlog_tail == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < num_shards; i++)
+    {
+        set->wake_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (set->wake_fds[i] == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Readable when another shard sent something or made room in a full link */
+int shard_wake_fd(const struct shard_set *set)
+{
+    return set->wake_fds[set->self];
+}
+
+/* Send a frame to another shard, in order with everything sent to it before */
+void shard_send(struct shard_set *set, int to, uint8_t kind, uint32_t target,
+                const char *sender_name, const void *frame, size_t len)
+{
+    struct shard_backlog *entry;
+    struct shard_msg msg;
+    int r;
+
+    msg.kind = kind;
+    msg.len = len;
+    msg.target = target;
+    snprintf(msg.sender_name, sizeof(msg.sender_name), "%s", sender_name != NULL ? sender_name : "");
+    memcpy(msg.frame, frame, len);
+
+    if (set->backlog[to] == NULL)
+    {
+        r = link_push(link_between(set, set->self, to), &msg);
+        if (r == 1)
+        {
+            wake(set, to);
+        }
+        if (r != -1)
+        {
+            return;
+        }
+    }
+
+    /* Queue behind what is already waiting */
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&entry->msg, &msg, msg_size(&msg));
+    entry->next = NULL;
+    if (set->backlog_tail[to] != NULL)
+    {
+        set->backlog_tail[to]->next = entry;
+    }
+    else
+    {
+        set->backlog[to] = entry;
+    }
+    set->backlog_tail[to] = entry;
+    flush_backlog(set, to);
+}
+
+/* Take the next message sent to this shard. Returns 0 if there is none. */
+int shard_receive(struct shard_set *set, struct shard_msg *msg)
+{
+    struct shard_link *link;
+    uint32_t head;
+
+    for (int i = 0; i < set->num_shards; i++)
+    {
+        if (i == set->self)
+        {
+            continue;
+        }
+        link = link_between(set, i, set->self);
+        head = link->head;
+        if (head == __atomic_load_n(&link->tail, __ATOMIC_SEQ_CST))
+        {
+            continue;
+        }
+        memcpy(msg, &link->slots[head & (SHARD_LINK_SLOTS - 1)],
+               msg_size(&link->slots[head & (SHARD_LINK_SLOTS - 1)]));
+        __atomic_store_n(&link->head, head + 1, __ATOMIC_SEQ_CST);
+
+        /* The producer is waiting for room */
+        if (__atomic_load_n(&link->blocked, __ATOMIC_SEQ_CST))
+        {
+            __atomic_store_n(&link->blocked, 0, __ATOMIC_SEQ_CST);
+            wake(set, i);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Push whatever waits for links that were full */
+void shard_retry(struct shard_set *set)
+{
+    for (int i = 0; i < set->num_shards; i++)
+    {
+        if (set->backlog[i] != NULL)
+        {
+            flush_backlog(set, i);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <stdint.h>
+#include "msg_structure.h"
+
+#define SHARD_LINK_SLOTS 256            /* Messages in flight per link, power of two */
+
+/* Kinds of messages between shards */
+#define SHARD_ROUTE 1                   /* A client frame for the receiving shard to route, on behalf of sender_name */
+#define SHARD_DELIVER 2                 /* A server frame for the local client with session id target */
+
+struct shard_msg {
+    uint8_t kind;
+    uint16_t len;                       /* Bytes of frame */
+    uint32_t target;
+    char sender_name[USER_NAME_LEN];
+    char frame[FRAME_MAX];
+};
+
+/* Single-producer, single-consumer ring from one shard to another, in memory
+ * shared by all shards. blocked is set by the producer when the ring was full
+ * so the consumer wakes it once there is room again.
+ */
+struct shard_link {
+    uint32_t head;                      /* Next slot to read, written by the consumer */
+    uint32_t tail;                      /* Next slot to write, written by the producer */
+    uint32_t blocked;
+    struct shard_msg slots[SHARD_LINK_SLOTS];
+};
+
+/* Messages that did not fit into a full link, oldest first */
+struct shard_backlog {
+    struct shard_backlog *next;
+    struct shard_msg msg;
+};
+
+struct shard_set {
+    int num_shards;
+    int self;                           /* Shard of this process, set after the fork */
+    struct shard_link *links;           /* links[from * num_shards + to] */
+    int *wake_fds;                      /* eventfd of every shard, created before the fork */
+    struct shard_backlog **backlog;     /* Per destination, private to this process */
+    struct shard_backlog **backlog_tail;
+};
+
+int shard_setup(struct shard_set *set, int num_shards);
+int shard_wake_fd(const struct shard_set *set);
+void shard_send(struct shard_set *set, int to, uint8_t kind, uint32_t target,
+                const char *sender_name, const void *frame, size_t len);
+int shard_receive(struct shard_set *set, struct shard_msg *msg);
+void shard_retry(struct shard_set *set);
+
+#endif
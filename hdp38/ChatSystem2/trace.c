@@ -0,0 +1,107 @@
+/* Recording of the client traffic of the chat server.
+ *
+ * With -T the server appends every frame it accepts from a client to a
+ * trace file, after unpacking batches, with the time it arrived and the
+ * session id of the sender. For a join the id is the one the server handed
+ * out, which is what lets chat_replay map the ids in later frames onto the
+ * clients it creates. Records go through a large stdio buffer, so recording
+ * costs a copy per frame and a write per megabyte; what is still buffered
+ * when the server crashes is lost.
+ *
+ * Student/team name: Hoang Pham and Nicholas Syrylo
+ */
+#define _POSIX_C_SOURCE 200809L // For clock_gettime()
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_BUFFER (1 << 20)
+
+/* Start a new trace file */
+int trace_create(struct trace *trace, const char *path)
+{
+    struct trace_header hdr;
+    struct timespec now;
+
+    trace->file = fopen(path, "wb");
+    if (trace->file == NULL)
+    {
+        return -1;
+    }
+    setvbuf(trace->file, NULL, _IOFBF, TRACE_BUFFER);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    hdr.wire_version = WIRE_VERSION;
+    if (fwrite(&hdr, sizeof(hdr), 1, trace->file) != 1)
+    {
+        fclose(trace->file);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    trace->start_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    return 0;
+}
+
+/* Open a trace for reading. Returns -1 if it is not a trace of this wire format. */
+int trace_open(struct trace *trace, const char *path)
+{
+    struct trace_header hdr;
+
+    trace->file = fopen(path, "rb");
+    if (trace->file == NULL)
+    {
+        return -1;
+    }
+    setvbuf(trace->file, NULL, _IOFBF, TRACE_BUFFER);
+    if (fread(&hdr, sizeof(hdr), 1, trace->file) != 1 || hdr.magic != TRACE_MAGIC ||
+        hdr.version != TRACE_VERSION || hdr.wire_version != WIRE_VERSION)
+    {
+        fclose(trace->file);
+        return -1;
+    }
+    trace->start_ns = 0;
+    return 0;
+}
+
+void trace_close(struct trace *trace)
+{
+    if (fclose(trace->file) == EOF)
+    {
+        perror("fclose");
+    }
+}
+
+/* Record a client frame received at now_ns */
+void trace_write(struct trace *trace, int64_t now_ns, uint32_t session, const struct frame *f)
+{
+    struct trace_record rec;
+
+    rec.time_ns = now_ns - trace->start_ns;
+    rec.session = session;
+    rec.len = frame_size(f);
+    rec.pad = 0;
+    if (fwrite(&rec, sizeof(rec), 1, trace->file) != 1 || fwrite(f->u.buf, rec.len, 1, trace->file) != 1)
+    {
+        perror("fwrite");
+    }
+}
+
+/* Read the next record into rec and f. Returns 1, or 0 at the end of the
+ * trace and -1 if it is damaged.
+ */
+int trace_read(struct trace *trace, struct trace_record *rec, struct frame *f)
+{
+    if (fread(rec, sizeof(*rec), 1, trace->file) != 1)
+    {
+        return feof(trace->file) ? 0 : -1;
+    }
+    if (rec->len > FRAME_MAX || fread(f->u.buf, rec->len, 1, trace->file) != 1 || frame_check(f, rec->len) == -1)
+    {
+        return -1;
+    }
+    return 1;
+}
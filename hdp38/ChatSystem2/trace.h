@@ -0,0 +1,38 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "msg_structure.h"
+
+#define TRACE_MAGIC 0x52544843u         /* "CHTR" */
+#define TRACE_VERSION 1
+
+/* Start of a trace file */
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;                   /* TRACE_VERSION */
+    uint32_t wire_version;              /* WIRE_VERSION of the recorded frames */
+    uint32_t pad;
+};
+
+/* One received client frame, followed by len bytes of it */
+struct trace_record {
+    uint64_t time_ns;                   /* Monotonic time since the trace started */
+    uint32_t session;                   /* Session id of the sender, the one assigned for a join */
+    uint16_t len;
+    uint16_t pad;
+};
+
+struct trace {
+    FILE *file;
+    int64_t start_ns;
+};
+
+int trace_create(struct trace *trace, const char *path);
+int trace_open(struct trace *trace, const char *path);
+void trace_close(struct trace *trace);
+void trace_write(struct trace *trace, int64_t now_ns, uint32_t session, const struct frame *f);
+int trace_read(struct trace *trace, struct trace_record *rec, struct frame *f);
+
+#endif